@@ -28,6 +28,7 @@
 #include "llvm/Analysis/LoopAnalysisManager.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/PassManager.h"
 #include <map>
@@ -38,6 +39,72 @@ namespace nisse {
 /// \brief Pointer to a Basic Block
 using BlockPtr = llvm::BasicBlock *;
 
+/// \brief The contents of the .graph file of each function, when the analyses
+/// keep them in memory instead of writing them.
+using GraphMap = std::map<std::string, std::string>;
+
+/// \brief The ways the instrumentation can update the counter-array.
+enum class CounterMode {
+  Plain,  ///< A load, add and store on a global array.
+  Atomic, ///< A relaxed atomic add on a global array.
+  Sharded ///< A load, add and store on a thread-local shard of the array.
+};
+
+/// \enum CounterLayout
+///
+/// \brief How the slots of the counter-array are assigned to the edges.
+enum class CounterLayout {
+  Module, ///< In the order of the functions in the module.
+  Loops,  ///< Hot functions first, by the loop depth of their counters.
+  Profile ///< Hot functions first, by their counts in a previous profile.
+};
+
+/// \enum EdgeWeighting
+///
+/// \brief How the edges are weighted before the maximum spanning tree is
+/// built: the heaviest edges go in the tree, and get no counter.
+enum class EdgeWeighting {
+  Uniform, ///< Every edge has the same weight.
+  Static,  ///< The frequency of the edge estimated by BlockFrequencyInfo.
+  Profile  ///< The count of the edge in a previous profile.
+};
+
+/// \struct Counters
+///
+/// \brief The array of counters used by the instrumentation, along with the
+/// way its slots are updated.
+///
+/// In compact mode, the slots of the array are 32 bits wide, and the carries
+/// out of them are added to the matching slot of a 64-bit spill array. The
+/// branches to these rare spills are only recorded by createIncr, since
+/// splitting blocks would move the instrumentation points of other edges;
+/// insertOverflowSpills inserts them once a function is instrumented.
+struct Counters {
+  llvm::Value *array; ///< The counter-array, or the thread's shard of it.
+  CounterMode mode;   ///< How the slots of the array are updated.
+  llvm::Value *spill = nullptr; ///< The spill array, in compact mode.
+
+  /// The conditions of pending spills, with the slot they spill.
+  mutable std::vector<std::pair<llvm::Instruction *, llvm::Value *>> overflows;
+
+  /// \brief Adds a value to a slot of the array.
+  /// \param builder The builder where to insert the update.
+  /// \param i The index of the slot to update.
+  /// \param incr The i64 value to add to the slot.
+  void createIncr(llvm::IRBuilder<> &builder, int i, llvm::Value *incr) const;
+
+  /// \brief Adds a value to a slot of the array chosen at run time.
+  /// \param builder The builder where to insert the update.
+  /// \param i The i64 index of the slot to update.
+  /// \param incr The i64 value to add to the slot.
+  void createIncr(llvm::IRBuilder<> &builder, llvm::Value *i,
+                  llvm::Value *incr) const;
+
+  /// \brief Inserts the spills recorded by createIncr, behind unlikely
+  /// branches.
+  void insertOverflowSpills() const;
+};
+
 /// \struct Edge
 ///
 /// \brief Representation of a CFG edge connecting two basic blocks.
@@ -48,6 +115,7 @@ private:
   BlockPtr dest;   ///< The destination of the edge.
   int index;       ///< Index of the edge.
   int weight;      ///< An expectation of how often this edge will be executed.
+  int successor;   ///< The successor of origin that is dest, or -1.
 
   bool flagSESE; ///< Flag to use if the edge is instrumenting a SESE region.
 
@@ -55,16 +123,41 @@ private:
   llvm::Value *initValue; ///< User defined initial value (for well-founded loops).
   double incrValue; ///< User defined increment value (for well-founded loops).
   llvm::SmallVector<BlockPtr> exitBlocks; ///< List of exit blocks (for well-founded loops).
+  const llvm::SCEV *tripCount = nullptr; ///< Backedge-taken count of the loop (for trip-count counters).
+  BlockPtr tripCountPreheader = nullptr; ///< Preheader of that loop, where the count is computed.
+  bool tripCountAtPreheader = false; ///< If the count is added in the preheader rather than at the exits.
+  const llvm::SCEV *stride = nullptr; ///< Loop-invariant step of indVar, when it is not a constant (for well-founded loops).
+  BlockPtr stridePreheader = nullptr; ///< Preheader of that loop, where the stride is computed.
+  llvm::Value *invariantCondition = nullptr; ///< Loop-invariant condition of the branch the edge leaves (for invariant branches).
+  bool invariantWhenTrue = false; ///< If the edge is taken when that condition holds.
+  bool invariantExitsAtHeader = false; ///< If the loop of that branch only exits from its header.
+
+  BlockPtr loopPreheader = nullptr; ///< Preheader of the outermost loop the counter can be promoted in.
+  llvm::SmallVector<BlockPtr> loopExits; ///< Exit blocks of that loop.
+  bool innermost = false; ///< If the counter is in an innermost loop.
+
+  /// \brief Splits the edge if it is critical, so that its counter goes in
+  /// the new block. Only the edges that get a counter are split.
+  void splitIfCritical();
 
   /// \brief Instruments the edge with an increment counter.
   /// \param i The index of the array to increment.
-  /// \param inst The instruction to the counter-array.
-  void insertSimpleIncrFn(int i, llvm::Value *inst);
+  /// \param counters The counter-array.
+  void insertSimpleIncrFn(int i, const Counters &counters);
 
   /// \brief Instruments the edge with a well-founded loop counter.
   /// \param i The index of the array to increment.
-  /// \param inst The instruction to the counter-array.
-  void insertSESEIncrFn(int i, llvm::Value *inst);
+  /// \param counters The counter-array.
+  /// \param stride The symbolic increment, as an i64 computed in the
+  /// preheader, or nullptr if the increment is a constant.
+  void insertSESEIncrFn(int i, const Counters &counters,
+                        llvm::Value *stride = nullptr);
+
+  /// \brief Instruments an edge out of an indirectbr, which cannot be split,
+  /// by adding whether the target address is the edge's destination.
+  /// \param i The index of the array to increment.
+  /// \param counters The counter-array.
+  void insertAddressIncrFn(int i, const Counters &counters);
 
   /// \brief Casts a value to i32.
   /// \param inst The value to cast.
@@ -81,8 +174,9 @@ private:
   /// \brief Computes the hook to insert the KS counter.
   /// If the source block terminates with an absolute jump, the counter is
   /// placed at the end of that block. If not, it is placed at the start of the
-  /// destination block. If the hooked block is the entry block, the counter
-  /// will always be placed at the end of the block.
+  /// destination block, which is only exact once critical edges are split. If
+  /// the hooked block is the entry block, the counter will always be placed at
+  /// the end of the block.
   /// \return The pointer to the hook for the counter.
   llvm::Instruction *getInstrumentationPoint() const;
 
@@ -93,9 +187,12 @@ public:
   /// \param index An index for the edge.
   /// \param weight (optional) An expectation of how often the edge will be
   /// executed.
-  Edge(BlockPtr origin, BlockPtr dest, int index, int weight = 1)
+  /// \param successor (optional) The number of the successor of origin that
+  /// the edge follows, needed to split the edge.
+  Edge(BlockPtr origin, BlockPtr dest, int index, int weight = 1,
+       int successor = -1)
       : origin(origin), dest(dest), index(index), weight(weight),
-        flagSESE(false){};
+        successor(successor), flagSESE(false){};
 
   /// \brief Getter for the destination of the edge.
   /// \return The destination of the edge.
@@ -105,6 +202,17 @@ public:
   /// \return The destination of the edge.
   BlockPtr getDest() const;
 
+  /// \brief Checks if the edge is critical: its origin has several
+  /// successors, and its destination several predecessors.
+  /// \return true if the edge is critical, and can be split.
+  bool isCritical() const;
+
+  /// \brief Checks if the edge is counted at its origin, by comparing the
+  /// target address: it leaves an indirectbr, and either its destination has
+  /// several predecessors, or -nisse-dispatch-counters is set.
+  /// \return true if the edge is counted by insertAddressIncrFn.
+  bool isCountedByAddress() const;
+
   /// \brief Sets the variables for a well founded loop's back edge.
   /// \param indVar The induction variable.
   /// \param initValue The induction variable's original value.
@@ -116,12 +224,116 @@ public:
                llvm::SmallVector<BlockPtr> &exitBlocks, int weight = 0);
 
   /// \brief Sets the variables for a well founded loop's back edge.
-  bool isSESE();
+  bool isSESE() const;
+
+  /// \brief Sets the variables for a well founded loop's back edge, whose
+  /// induction variable is incremented by a loop-invariant value, known not to
+  /// be zero when the loop is entered. A constant increment is preferred.
+  /// \param indVar The induction variable.
+  /// \param initValue The induction variable's original value.
+  /// \param stride The induction variable's increment.
+  /// \param preheader The loop's preheader, where the increment is computed.
+  /// \param exitBlocks The loop's exit blocks.
+  void setStridedSESE(llvm::Value *indVar, llvm::Value *initValue,
+                      const llvm::SCEV *stride, BlockPtr preheader,
+                      llvm::SmallVector<BlockPtr> &exitBlocks);
+
+  /// \brief Sets the variables for an edge out of a branch whose condition is
+  /// loop-invariant, and which runs once in every iteration of its loop: the
+  /// edge is taken in every iteration or in none, so its count is the number
+  /// of iterations, given by the induction variable set with setSESE or
+  /// setStridedSESE, when the condition agrees.
+  /// \param condition The condition of the branch.
+  /// \param whenTrue If the edge is taken when the condition holds.
+  /// \param exitsAtHeader If the loop only exits from its header, so that the
+  /// branch runs as many times as the back edge.
+  void setInvariantBranch(llvm::Value *condition, bool whenTrue,
+                          bool exitsAtHeader);
+
+  /// \brief Checks if the edge's induction variable has a symbolic increment.
+  /// \return true if setStridedSESE was called last.
+  bool hasStride() const;
+
+  /// \brief Getter for the symbolic increment of the induction variable.
+  /// \return The increment, or nullptr.
+  const llvm::SCEV *getStride() const;
+
+  /// \brief Getter for the preheader where the increment is computed.
+  /// \return The preheader, or nullptr.
+  BlockPtr getStridePreheader() const;
+
+  /// \brief Counts a loop's back edge with the loop's backedge-taken count,
+  /// computed once in its preheader, and added either in the preheader, if the
+  /// loop is known to run until its computed exit, or in its exit blocks.
+  /// \param tripCount The backedge-taken count of the loop.
+  /// \param preheader The loop's preheader.
+  /// \param exitBlocks The loop's exit blocks.
+  /// \param atPreheader If the count is added in the preheader.
+  void setTripCount(const llvm::SCEV *tripCount, BlockPtr preheader,
+                    llvm::SmallVector<BlockPtr> &exitBlocks, bool atPreheader);
+
+  /// \brief Checks if the edge is counted with a loop's trip count.
+  /// \return true if setTripCount was called.
+  bool hasTripCount() const;
+
+  /// \brief Getter for the backedge-taken count of the loop.
+  /// \return The count, or nullptr.
+  const llvm::SCEV *getTripCount() const;
+
+  /// \brief Getter for the preheader where the trip count is computed.
+  /// \return The preheader, or nullptr.
+  BlockPtr getTripCountPreheader() const;
+
+  /// \brief Instruments the edge with a trip-count counter.
+  /// \param i The index of the array to increment.
+  /// \param counters The counter-array.
+  /// \param count The trip count, as an i64 computed in the preheader.
+  void insertTripCountIncrFn(int i, const Counters &counters,
+                             llvm::Value *count);
+
+  /// \brief Instruments the edge with a well-founded loop counter whose
+  /// induction variable has a symbolic increment.
+  /// \param i The index of the array to increment.
+  /// \param counters The counter-array.
+  /// \param stride The increment, as an i64 computed in the preheader.
+  void insertStridedIncrFn(int i, const Counters &counters,
+                           llvm::Value *stride);
+
+  /// \brief Records the outermost loop around the edge's counter that has a
+  /// preheader and dedicated exit blocks, so that the counter can be kept in a
+  /// register while the loop runs.
+  /// \param LI The function's loop info.
+  void setPromotionLoop(llvm::LoopInfo &LI);
+
+  /// \brief Checks if the edge's counter is in a loop without subloops, which
+  /// the loop vectorizer may transform. Set by setPromotionLoop.
+  /// \return true if the edge's counter is in an innermost loop.
+  bool isInInnermostLoop() const;
+
+  /// \brief Checks if the edge's counter can be kept in a register.
+  /// \return true if the edge is in a loop with a preheader and dedicated
+  /// exits, and is not instrumented with a well-founded loop counter or at a
+  /// dispatch.
+  bool isPromotable() const;
+
+  /// \brief Instruments the edge with a counter kept in a local variable,
+  /// which is zeroed in the loop's preheader, and added to the counter-array
+  /// in the loop's exit blocks. The local variable is meant to be promoted to
+  /// a register afterwards.
+  /// \param i The index of the array to increment.
+  /// \param counters The counter-array.
+  /// \return The local variable holding the counter.
+  llvm::AllocaInst *insertPromotedIncrFn(int i, const Counters &counters);
 
   /// \brief Instruments the edge.
   /// \param i The index of the array to increment.
-  /// \param inst The instruction to the counter-array.
-  void insertIncrFn(int i, llvm::Value *inst);
+  /// \param counters The counter-array.
+  void insertIncrFn(int i, const Counters &counters);
+
+  /// \brief Getter for the block where the edge's counter is updated.
+  /// \return The block of the instrumentation point, or the first exit block
+  /// of the loop for a well-founded loop counter.
+  BlockPtr getUpdateBlock() const;
 
   /// \brief Getter for the edge's index.
   /// \return the edge's index.
@@ -215,10 +427,31 @@ public:
   /// \return the corresponding number
   static std::string removebb(const std::string &s);
 
-  /// \brief Generates the set of edges of a function's CFG.
+  /// \brief Generates the set of edges of a function's CFG, weighted as
+  /// chosen by -nisse-edge-weights.
   /// \param F The function to compute the edges of.
+  /// \param FAM The function analysis manager, for the static weights.
   /// \return a vector containing the edges of F.
-  static std::multiset<Edge> generateEdges(llvm::Function &F);
+  static std::multiset<Edge> generateEdges(llvm::Function &F,
+                                           llvm::FunctionAnalysisManager &FAM);
+
+  /// \brief Checks if a block ends with a switch whose edges are counted by a
+  /// single indexed counter, with -nisse-dispatch-counters. Its case values
+  /// must be dense enough to index a table of slots.
+  /// \param BB The block to check.
+  /// \return true if the edges out of BB are counted at the dispatch.
+  static bool isIndexedDispatch(const llvm::BasicBlock *BB);
+
+  /// \brief Checks if a block ends with an indirectbr whose edges are handled
+  /// at the dispatch, with -nisse-dispatch-counters.
+  /// \param BB The block to check.
+  /// \return true if the edges out of BB are counted at the dispatch.
+  static bool isIndirectDispatch(const llvm::BasicBlock *BB);
+
+  /// \brief Checks if the instrumentation must keep innermost loops
+  /// vectorizable, with -nisse-vectorizer-friendly.
+  /// \return true if innermost loops must not update counters in memory.
+  static bool isVectorizerFriendly();
 
   /// \brief Generates the maximum spanning tree of a set of F's edges.
   /// \param F The function the edges belong to.
@@ -228,15 +461,46 @@ public:
   static std::pair<std::multiset<Edge>, std::multiset<Edge>>
   generateSTrev(llvm::Function &F, std::multiset<Edge> &edges);
 
+  /// \brief Computes the control-equivalence classes of F's edges: two edges
+  /// are in the same class if every cycle of the CFG, closed by the edge from
+  /// the return block to the entry, goes through both or neither, so that they
+  /// are always taken as many times.
+  /// \param F The function the edges belong to.
+  /// \param ST The edges in the spanning tree.
+  /// \param rev The edges out of the spanning tree.
+  /// \return The class of each edge, by index. Edges that are in no cycle are
+  /// in class 0, and equivalent to no other edge.
+  static std::map<int, uint64_t>
+  identifyEquivalentEdges(llvm::Function &F, const std::multiset<Edge> &ST,
+                          const std::multiset<Edge> &rev);
+
+  /// \brief Moves each counter to the edge of its class that is the cheapest
+  /// to instrument. A class holds at most one edge out of the spanning tree,
+  /// and swapping it with an edge of the tree leaves a spanning tree.
+  /// \param F The function the edges belong to.
+  /// \param ST The edges in the spanning tree.
+  /// \param rev The edges out of the spanning tree, which get the counters.
+  static void shareEquivalentCounters(llvm::Function &F,
+                                      std::multiset<Edge> &ST,
+                                      std::multiset<Edge> &rev);
+
+  /// \brief Records, for each edge, the loop its counter can be promoted in.
+  /// \param edges The CFG's edges.
+  /// \param LI The function's loop info.
+  static void identifyPromotionLoops(std::multiset<Edge> &edges,
+                                     llvm::LoopInfo &LI);
+
   /// \brief Saves the CFG, the Spanning Tree and the instrumented edges to a
   /// file.
   /// \param F The function the edges belong to.
   /// \param edges The set of edges to generate the maximum spanning tree of.
   /// \param STrev the set of edges in the spanning tree and the set of
   /// edges in its complementary.
+  /// \param graphs If not null, where the graph is kept instead of the file.
   static void
   printGraph(llvm::Function &F, std::multiset<Edge> &edges,
-             std::pair<std::multiset<Edge>, std::multiset<Edge>> &STrev);
+             std::pair<std::multiset<Edge>, std::multiset<Edge>> &STrev,
+             GraphMap *graphs = nullptr);
 };
 
 /// \struct NisseAnalysis
@@ -246,6 +510,7 @@ public:
 struct NisseAnalysis : public llvm::AnalysisInfoMixin<NisseAnalysis> {
 
 private:
+  GraphMap *Graphs = nullptr; ///< Where the graphs go, if not to files.
   llvm::ScalarEvolution *SE;
   llvm::DominatorTree DT;
   llvm::PostDominatorTree PDT;
@@ -277,19 +542,53 @@ private:
   /// is modified by a constant value each time the loop goes through a set of
   /// control-equivalent blocks, and is not modified otherwise). It also
   /// modifies the corresponding edge in edges.
+  /// \param L The loop.
   /// \param SE The function's scalar evolution.
   /// \param edges The CFG's edges.
   /// \param PHI The PHI node to analyse.
   /// \param incomingBlock The loop's incoming block.
   /// \param backBlock The outgoing block of the loop's back edge.
   /// \param exitBlocks The loop's exit blocks.
-  /// \param DT The function's dominator tree.
   /// \return true if the variable is a well founded branch variable.
-  bool identifyBranchVariable(llvm::ScalarEvolution &SE,
+  bool identifyBranchVariable(llvm::Loop *L, llvm::ScalarEvolution &SE,
                               std::multiset<Edge> &edges, llvm::PHINode *PHI,
                               BlockPtr incomingBlock, BlockPtr backBlock,
                               llvm::SmallVector<BlockPtr> &exitBlocks);
 
+  /// \brief Identifies the branches of a loop whose condition is invariant in
+  /// the loop, and which run in every iteration of it: the edges out of them
+  /// are counted at the exits, from an induction variable of the loop and the
+  /// condition. It modifies the corresponding edges in edges.
+  /// \param L The loop.
+  /// \param SE The function's scalar evolution.
+  /// \param edges The CFG's edges.
+  /// \param exitBlocks The loop's exit blocks.
+  void identifyInvariantBranches(llvm::Loop *L, llvm::ScalarEvolution &SE,
+                                 std::multiset<Edge> &edges,
+                                 llvm::SmallVector<BlockPtr> &exitBlocks);
+
+  /// \brief Identifies if ScalarEvolution computes the backedge-taken count of
+  /// a loop, which then counts its back edge, and modifies the corresponding
+  /// edge in edges.
+  /// \param L The loop.
+  /// \param SE The function's scalar evolution.
+  /// \param edges The CFG's edges.
+  /// \param backEdge The loop's back edge.
+  /// \return true if the back edge is counted with the trip count.
+  bool identifyTripCount(llvm::Loop *L, llvm::ScalarEvolution &SE,
+                         std::multiset<Edge> &edges, Edge &backEdge);
+
+  /// \brief Sums the trip count of a loop over the iterations of its parent,
+  /// if the loop runs once per iteration of its parent, and its count is an
+  /// add recurrence of the parent, or invariant in it.
+  /// \param L The loop.
+  /// \param count The number of times the back edge of L is taken per run.
+  /// \param SE The function's scalar evolution.
+  /// \return The number of times the back edge is taken per run of the
+  /// parent loop, or nullptr.
+  const llvm::SCEV *sumOverParentLoop(llvm::Loop *L, const llvm::SCEV *count,
+                                      llvm::ScalarEvolution &SE);
+
   /// \brief Identifies well founded edges for Nisse instrumentation.
   /// \param L Loop to instrument.
   /// \param SE The function's scalar evolution.
@@ -306,6 +605,11 @@ public:
   /// identifies that particular analysis pass type.
   static llvm::AnalysisKey Key;
 
+  /// \brief Creates the analysis.
+  /// \param Graphs If not null, where the graphs of the functions are kept,
+  /// instead of being written to .graph files.
+  explicit NisseAnalysis(GraphMap *Graphs = nullptr) : Graphs(Graphs) {}
+
   /// \brief The analysis pass' run function.
   /// \param F The function to analyse.
   /// \param FAM The current FunctionAnalysisManager.
@@ -321,10 +625,21 @@ struct NissePass : public llvm::PassInfoMixin<NissePass> {
 private:
   llvm::GlobalVariable *CounterArray = nullptr;
   llvm::GlobalVariable *IndexArray = nullptr;
+  llvm::GlobalVariable *TotalArray = nullptr; ///< Merged shards (sharded mode).
+  llvm::GlobalVariable *ShardFlag = nullptr;  ///< Per-thread registration flag.
+  llvm::GlobalVariable *SpillArray = nullptr; ///< High bits (compact mode).
+  llvm::GlobalVariable *FunctionTable = nullptr; ///< Function descriptors.
   std::map<std::string, int> FunctionSize;
   int NumEdges = 0;
-  int Offset = 0;
+  int NumSlots = 0; ///< Size of the counter-array, with the padding.
+  std::map<llvm::Function *, int> FunctionOffset; ///< Slot of the first counter.
+  /// The slot of each edge of a function, in the order of its reverseSTEdges.
+  std::map<llvm::Function *, std::vector<int>> Slots;
   std::ofstream outfile;
+  /// The name of the module's descriptor, for the in-process API of NisseJIT.h,
+  /// or empty when the module registers with the runtime.
+  std::string ModuleSymbol;
+  CounterMode JITCounterMode = CounterMode::Plain; ///< With a ModuleSymbol.
 
 protected:
   /// \brief Inserts the initialization code, which creates a
@@ -335,16 +650,119 @@ protected:
   std::pair<llvm::Value *, llvm::Value *>
   insertEntryFn(llvm::Function &F, std::multiset<Edge> &reverseSTEdges);
 
-  /// \brief Inserts a call to the function that prints the results of the
-  /// counter.
-  /// \param F The function begin instrumented.
-  /// \param counterInst The instruction pointer to the counter array.
-  /// \param indexInst The instruction pointer to the index array.
-  /// \param size The size of the counter and index arrays.
-  void insertExitFn(llvm::Module &M, llvm::Function &F, llvm::Value *counterInst,
-                    llvm::Value *indexInst, int size);
+  /// \brief Returns the type of the function descriptors, which is
+  /// { name, MD5 hash of the name, offset of the first counter, number of
+  /// counters }.
+  /// \param Ctx The module's context.
+  /// \return The descriptor type.
+  static llvm::StructType *getFunctionDescriptorType(llvm::LLVMContext &Ctx);
+
+  /// \brief Creates the constant descriptor of an instrumented function.
+  /// \param M The module being instrumented.
+  /// \param F The function described.
+  /// \param offset The slot of the function's first counter.
+  /// \param size The number of counters of the function.
+  /// \return The descriptor.
+  llvm::Constant *createFunctionDescriptor(llvm::Module &M, llvm::Function &F,
+                                           int offset, int size);
+
+  /// \brief Assigns a slot of the counter-array to each instrumented edge,
+  /// following -nisse-counter-layout. The counters of a function always take
+  /// contiguous slots, and the functions keep their module order in the
+  /// function table, but hot functions may be moved first and aligned on
+  /// cache lines, which leaves unused slots in the array.
+  /// \param M The module being instrumented.
+  /// \param FAM The function analysis manager.
+  /// \param lineSlots The number of counters in a cache line.
+  template <typename AnalysisT>
+  void layoutCounters(llvm::Module &M, llvm::FunctionAnalysisManager &FAM,
+                      int lineSlots);
+
+  /// \brief Inserts, before a switch, the single counter of its edges, whose
+  /// slot is loaded from a constant table indexed by the switch's condition.
+  /// \param M The module being instrumented.
+  /// \param BB The block of the switch.
+  /// \param slots The slot of the edge to each successor of the switch.
+  /// \param counters The counter-array.
+  void insertDispatchIncr(llvm::Module &M, llvm::BasicBlock *BB,
+                          const std::vector<int> &slots,
+                          const Counters &counters);
+
+  /// \brief Computes the trip counts of the loops whose back edges get
+  /// trip-count counters, in their preheaders, before the CFG is changed.
+  /// \param F The function being instrumented.
+  /// \param edges The edges that get a counter.
+  /// \param FAM The function analysis manager.
+  /// \return The trip count of each such edge, by index.
+  std::map<int, llvm::Value *>
+  expandTripCounts(llvm::Function &F, const std::multiset<Edge> &edges,
+                   llvm::FunctionAnalysisManager &FAM);
+
+  /// \brief Computes the symbolic increments of the induction variables that
+  /// count back edges, in the preheaders of their loops, before the CFG is
+  /// changed.
+  /// \param F The function being instrumented.
+  /// \param edges The edges that get a counter.
+  /// \param FAM The function analysis manager.
+  /// \return The increment of each such edge, by index.
+  std::map<int, llvm::Value *>
+  expandStrides(llvm::Function &F, const std::multiset<Edge> &edges,
+                llvm::FunctionAnalysisManager &FAM);
+
+  /// \brief Gives a function a fast copy without counters, and a new entry
+  /// block that runs the original blocks, which are instrumented afterwards,
+  /// on sampled calls only. The copies are only switched at the entry, as the
+  /// counters of a run that does not start at the entry would break the flow
+  /// conservation that the reconstruction of the frequencies relies on.
+  /// \param M The module being instrumented.
+  /// \param F The function to clone.
+  /// \param LI The loop info of the function, before cloning.
+  void insertSamplingDispatch(llvm::Module &M, llvm::Function &F,
+                              llvm::LoopInfo &LI);
+
+  /// \brief Inserts the module's descriptor (a struct nisse_module), a
+  /// constructor that registers it with the runtime, and a destructor that
+  /// unregisters it, which writes its profile.
+  /// \param M The module being instrumented.
+  /// \param capacity The number of slots of the counter-array.
+  /// \param flags The NISSE_MODULE_* flags of the module.
+  void insertModuleRegistration(llvm::Module &M, int capacity, int flags);
+
+  /// \brief Inserts, at the entry of a function, the code that registers the
+  /// counter shard of the current thread with the runtime the first time the
+  /// thread runs an instrumented function.
+  /// \param M The module being instrumented.
+  /// \param F The function being instrumented.
+  void insertShardRegistration(llvm::Module &M, llvm::Function &F);
+
+  /// \brief Emits a missed optimization remark for each innermost loop of an
+  /// instrumented function that still updates a counter in memory, which may
+  /// keep the loop vectorizer from transforming it.
+  /// \param M The module being instrumented.
+  /// \param F The instrumented function.
+  void reportInnermostLoopCounters(llvm::Module &M, llvm::Function &F);
+
+  /// \brief Instruments every function of a module with the edges chosen by
+  /// an analysis.
+  /// \param M The module to transform.
+  /// \param MAM The current ModuleAnalysisManager.
+  template <typename AnalysisT>
+  llvm::PreservedAnalyses instrumentModule(llvm::Module &M,
+                                           llvm::ModuleAnalysisManager &MAM);
 
 public:
+  /// \brief Creates a pass whose modules register with the runtime.
+  NissePass() = default;
+
+  /// \brief Creates a pass for the in-process API of NisseJIT.h: the module's
+  /// descriptor is an external global, found by its name once the module is
+  /// compiled, and the module writes no file and needs no runtime.
+  /// \param ModuleSymbol The name of the module's descriptor.
+  /// \param Mode How the counters are updated. Sharded counters need the
+  /// runtime, and are replaced by atomic ones.
+  NissePass(std::string ModuleSymbol, CounterMode Mode)
+      : ModuleSymbol(std::move(ModuleSymbol)), JITCounterMode(Mode) {}
+
   /// \brief The transformation pass' run function. Instruments the function
   /// given as argument for KS edge instrumentation.
   /// \param F The function to transform.
@@ -364,25 +782,27 @@ struct KSAnalysis : public llvm::AnalysisInfoMixin<KSAnalysis> {
   /// identifies that particular analysis pass type.
   static llvm::AnalysisKey Key;
 
+  /// \brief Creates the analysis.
+  /// \param Graphs If not null, where the graphs of the functions are kept,
+  /// instead of being written to .graph files.
+  explicit KSAnalysis(GraphMap *Graphs = nullptr) : Graphs(Graphs) {}
+
   /// \brief The analysis pass' run function.
   /// \param F The function to analyse.
   /// \param FAM The current FunctionAnalysisManager.
   /// \return A triple with the set of edges in F, a maximum spanning tree, and
   /// its complementary.
   Result run(llvm::Function &F, llvm::FunctionAnalysisManager &FAM);
+
+private:
+  GraphMap *Graphs = nullptr; ///< Where the graphs go, if not to files.
 };
 
 /// \brief Instruments a function for KS edge instrumentation.
 struct KSPass : public NissePass {
-private:
-  llvm::GlobalVariable *CounterArray = nullptr;
-  llvm::GlobalVariable *IndexArray = nullptr;
-  std::map<std::string, int> FunctionSize;
-  int NumEdges = 0;
-  int Offset = 0;
-  std::ofstream outfile;
-
 public:
+  using NissePass::NissePass;
+
   /// \brief The transformation pass' run function. Instruments the function
   /// given as argument for KS edge instrumentation.
   /// \param F The function to transform.
@@ -0,0 +1,115 @@
+//===-- NisseJIT.h -------------------------------------------*- C++ -*-===//
+// Copyright (C) 2023 Leon Frenot
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// This file contains the in-process API, which instruments modules that are
+/// then compiled with the ORC JIT, and reconstructs the frequencies of their
+/// edges and blocks from their counters, without any file or runtime.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef NISSE_JIT_H
+#define NISSE_JIT_H
+
+#include "Nisse.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Error.h"
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct nisse_module;
+
+namespace nisse {
+
+/// \brief The reconstructed frequencies of the edges and blocks of a function.
+/// Blocks are named by their number: the block named bbN in the instrumented
+/// module is N, and the entry block is 0.
+struct FunctionFrequencies {
+  /// The source and destination blocks of each edge, including the edge from
+  /// the exit block back to the entry block, which counts the calls.
+  std::vector<std::pair<std::string, std::string>> edges;
+  std::vector<long long> edgeCounts;            ///< The count of each edge.
+  std::map<std::string, long long> blockCounts; ///< The count of each block.
+};
+
+/// \brief The instrumentation used by a JITProfile.
+enum class JITInstrumentation {
+  Nisse, ///< The nisse pass, with well-founded edges.
+  KS     ///< The ks pass, with a maximum spanning tree only.
+};
+
+/// \class JITProfile
+///
+/// \brief The profile of a module compiled with the ORC JIT. The module is
+/// instrumented before it is added to the JIT, and its counters live in the
+/// memory that the JIT allocates for its globals. Once the module is compiled,
+/// attach finds its descriptor, and the frequencies can be read at any time.
+class JITProfile {
+public:
+  /// \brief Instruments a module, which is then added to the JIT as usual.
+  /// Its blocks are renamed bb0, bb1..., and its loops get dedicated
+  /// preheaders and exits, as the passes expect.
+  /// \param M The module to instrument.
+  /// \param Kind The instrumentation.
+  /// \param Mode How the counters are updated: Atomic is needed if several
+  /// threads run the module, and Sharded is replaced by Atomic.
+  /// \return The profile of the module.
+  static std::unique_ptr<JITProfile>
+  instrument(llvm::Module &M,
+             JITInstrumentation Kind = JITInstrumentation::Nisse,
+             CounterMode Mode = CounterMode::Plain);
+
+  /// \brief Finds the descriptor of the module, which compiles it if needed.
+  /// \param J The JIT the module was added to.
+  /// \param JD The JITDylib the module was added to.
+  /// \return An error if the descriptor is not found.
+  llvm::Error attach(llvm::orc::LLJIT &J, llvm::orc::JITDylib &JD);
+
+  /// \brief Finds the descriptor of a module added to the main JITDylib.
+  /// \param J The JIT the module was added to.
+  /// \return An error if the descriptor is not found.
+  llvm::Error attach(llvm::orc::LLJIT &J) {
+    return attach(J, J.getMainJITDylib());
+  }
+
+  /// \brief Reconstructs the frequencies of the instrumented functions from
+  /// the current values of the counters. The module must be attached.
+  /// \return The frequencies of each function, by name.
+  std::map<std::string, FunctionFrequencies> getFrequencies() const;
+
+  /// \brief Sets the counters back to zero, e.g. after a recompilation. No
+  /// thread should be running the module meanwhile.
+  void reset();
+
+  /// \brief Returns the name of the symbol of the module's descriptor.
+  const std::string &getSymbol() const { return Symbol; }
+
+private:
+  JITProfile() = default;
+
+  std::string Symbol;                     ///< The descriptor's name.
+  GraphMap Graphs;                        ///< The graph of each function.
+  const struct nisse_module *Descriptor = nullptr; ///< Set by attach.
+};
+
+} // namespace nisse
+
+#endif
@@ -0,0 +1,166 @@
+//===-- NisseProfile.h ----------------------------------------*- C -*-===//
+// Copyright (C) 2023 Leon Frenot
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// This file contains the data structures shared by the instrumentation, the
+/// runtime (lib/prof.c) and the tools that read profiles. It is included by
+/// both C and C++ code.
+///
+/// A binary profile file is a sequence of records, one per profiled
+/// execution. Each record starts with a nisse_profile_header, and all its
+/// fields are little endian. Offsets are relative to the start of the record.
+/// In continuous mode, the file holds a single record whose counters start at
+/// a page boundary, and are followed by the unused slots of the counter-array.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef NISSE_PROFILE_H
+#define NISSE_PROFILE_H
+
+#include <stdint.h>
+
+/// \brief The first 8 bytes of every binary profile record.
+#define NISSE_PROFILE_MAGIC "NISSEPRF"
+
+/// \brief The version of the binary profile format. Version 2 added the
+/// module_hash field, which version 1 records lack.
+#define NISSE_PROFILE_VERSION 2
+
+/// \brief Descriptor of an instrumented function, as emitted by the
+/// instrumentation in the nisse-functions table.
+struct nisse_function {
+  const char *name; ///< The function's name.
+  uint64_t hash;    ///< The MD5 hash of the function's name.
+  int32_t offset;   ///< The slot of the function's first counter.
+  int32_t size;     ///< The function's number of counters.
+};
+
+/// \brief Flag of a nisse_module whose counters are mapped onto the profile
+/// file while the program runs.
+#define NISSE_MODULE_CONTINUOUS 1
+
+/// \brief Flag of a nisse_module whose counters are 32 bits wide, and spill
+/// their carries to the spill array.
+#define NISSE_MODULE_COMPACT 2
+
+/// \brief Flag of a nisse_module whose profile is not written when it is
+/// unloaded, or when the program exits.
+#define NISSE_MODULE_NO_DUMP 4
+
+/// \brief Flag of a nisse_module with thread-local counters: its counters are
+/// the total array, to which the shards of the threads are added.
+#define NISSE_MODULE_SHARDED 8
+
+/// \brief Descriptor of an instrumented module, which the instrumentation
+/// passes to the runtime in a constructor, and again in a destructor, when the
+/// program exits or the shared object holding the module is unloaded.
+struct nisse_module {
+  long long *counters;                     ///< The counter-array.
+  int32_t *indices;                        ///< The index-array.
+  const struct nisse_function *functions;  ///< The function descriptors.
+  int32_t size;                            ///< The number of counters.
+  int32_t capacity;                        ///< The size of the counter-array.
+  int32_t num_functions;                   ///< The number of functions.
+  int32_t flags;                           ///< NISSE_MODULE_* flags.
+  long long *spill;                        ///< The spill array, or NULL.
+  const char *name;                        ///< The module's source file.
+};
+
+/// \brief Header of a binary profile record.
+struct nisse_profile_header {
+  char magic[8];             ///< NISSE_PROFILE_MAGIC, not NUL-terminated.
+  uint32_t version;          ///< NISSE_PROFILE_VERSION.
+  uint32_t num_functions;    ///< Number of function records.
+  uint64_t num_counters;     ///< Number of counters.
+  uint64_t functions_offset; ///< Offset of the function records.
+  uint64_t names_offset;     ///< Offset of the NUL-terminated names.
+  uint64_t indices_offset;   ///< Offset of the int32 edge index of each slot.
+  uint64_t counters_offset;  ///< Offset of the int64 counters.
+  uint64_t size;             ///< Size of the whole record.
+  uint64_t module_hash;      ///< FNV-1a hash of the module's name, or 0.
+};
+
+/// \brief Function record of a binary profile record.
+struct nisse_profile_function {
+  uint64_t hash;         ///< The MD5 hash of the function's name.
+  uint32_t offset;       ///< The slot of the function's first counter.
+  uint32_t num_counters; ///< The function's number of counters.
+  uint32_t name_offset;  ///< Offset of the name, from names_offset.
+  uint32_t name_size;    ///< Length of the name, without the NUL.
+};
+
+/// \brief The first 8 bytes of a snapshot file.
+#define NISSE_SNAPSHOT_MAGIC "NISSESNP"
+
+/// \brief The version of the snapshot file format.
+#define NISSE_SNAPSHOT_VERSION 1
+
+/// \brief Header of a snapshot file, which holds the deltas of the counters
+/// over successive intervals. It is followed by a binary profile record
+/// without counters, which describes the functions and the indices of the
+/// slots, and by a ring buffer of nisse_snapshot_record. Positions in the ring
+/// only grow, and are taken modulo its size; records may wrap around its end.
+/// All fields are little endian.
+struct nisse_snapshot_header {
+  char magic[8];            ///< NISSE_SNAPSHOT_MAGIC, not NUL-terminated.
+  uint32_t version;         ///< NISSE_SNAPSHOT_VERSION.
+  uint32_t interval_ms;     ///< The interval between two snapshots.
+  uint64_t metadata_offset; ///< Offset of the record describing the slots.
+  uint64_t ring_offset;     ///< Offset of the ring buffer.
+  uint64_t ring_size;       ///< Size of the ring buffer.
+  uint64_t head;            ///< Position after the newest record.
+  uint64_t tail;            ///< Position of the oldest record.
+  uint64_t reserved;        ///< Zero.
+};
+
+/// \brief Header of a snapshot record. It is followed by num_deltas pairs of
+/// LEB128 integers: the gap between the slot and the previous slot of the
+/// record (or the slot itself, for the first pair), minus one after the first
+/// pair, and the zigzag-encoded increase of the slot's counter since the
+/// previous record.
+struct nisse_snapshot_record {
+  uint32_t size;       ///< Size of the record, with its deltas.
+  uint32_t num_deltas; ///< Number of slots that changed.
+  uint64_t sequence;   ///< The number of the snapshot, starting from 1.
+  uint64_t time_ns;    ///< Time since the program started.
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// \brief Writes the profile of every registered module now, and resets
+/// their counters, so that the profile written at exit only holds the counts
+/// taken since. Modules in continuous mode are left out, as their profile is
+/// always up to date.
+void nisse_dump_profile(void);
+
+/// \brief Sets the sampling period of a program instrumented with
+/// -nisse-sampling: one call to an instrumented function in period runs the
+/// copy with counters. A period of zero disables sampling. The period is
+/// 1000 by default, or $NISSE_SAMPLE_PERIOD.
+void nisse_sample_set_period(int period);
+
+/// \brief Disables or enables again the sampling of a program instrumented
+/// with -nisse-sampling, keeping its period.
+void nisse_sample_enable(int enable);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
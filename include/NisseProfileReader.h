@@ -0,0 +1,175 @@
+//===-- NisseProfileReader.h ------------------------------*- C++ -*-===//
+// Copyright (C) 2023 Leon Frenot
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// This file contains the declarations of the functions that read binary
+/// profiles, which are shared by the passes and the tools.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef NISSE_PROFILE_READER_H
+#define NISSE_PROFILE_READER_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace nisse {
+
+/// \brief The pairs of edge index and count of a function's counters.
+using EdgeCounts = std::vector<std::pair<long long, long long>>;
+
+/// \brief Reads a little-endian integer from a buffer.
+/// \param buffer The buffer to read from.
+/// \param offset The offset of the integer in the buffer.
+/// \param bytes The size of the integer.
+/// \return The integer, whose bytes past the end of the buffer read as 0.
+uint64_t readLE(const std::string &buffer, uint64_t offset, int bytes);
+
+/// \brief The profiles of the modules of a binary profile: maps the hash of
+/// each module's name to the profiles of its functions, by name. Records
+/// written before modules were told apart have the hash 0.
+using ModuleProfiles = std::map<uint64_t, std::map<std::string, EdgeCounts>>;
+
+/// \brief Checks if a profile file is in the binary format.
+/// \param filename Path to the profile file.
+/// \return true if the file starts with the binary profile magic.
+bool isBinaryProfile(const std::string &filename);
+
+/// \brief Reads a binary profile, and sums the counters of each of its
+/// records.
+/// \param filename Path to the profile file.
+/// \param functionProfiles Maps each function's name to the pairs of edge
+/// index and count of its counters, sorted by edge index.
+/// \return false if the file is malformed.
+bool readBinaryProfile(const std::string &filename,
+                       std::map<std::string, EdgeCounts> &functionProfiles);
+
+/// \brief Reads a binary profile, and sums the counters of the records of
+/// each module.
+/// \param filename Path to the profile file.
+/// \param moduleProfiles The profiles of the modules.
+/// \return false if the file is malformed.
+bool readBinaryProfile(const std::string &filename,
+                       ModuleProfiles &moduleProfiles);
+
+/// \brief The instrumented functions of a module, with their number of
+/// counters, in the order of the info file written by the passes.
+using FunctionSizes = std::vector<std::pair<std::string, int>>;
+
+/// \brief Reads an info file written by the passes.
+/// \param filename Path to the info file.
+/// \param functions The functions listed in the file.
+/// \return false if the file could not be opened.
+bool readInfoFile(const std::string &filename, FunctionSizes &functions);
+
+/// \brief Reads a text profile, and sums the counters of each of the runs
+/// appended to it.
+/// \param filename Path to the profile file.
+/// \param functions The functions of the module, from its info file.
+/// \param functionProfiles Maps each function's name to the pairs of edge
+/// index and count of its counters, sorted by edge index.
+/// \return false if the file ends in the middle of a run.
+bool readTextProfile(const std::string &filename,
+                     const FunctionSizes &functions,
+                     std::map<std::string, EdgeCounts> &functionProfiles);
+
+/// \brief The reconstructed counts of a function's edges, by the names of
+/// their origin and destination vertices. Parallel edges, such as two cases of
+/// a switch with the same destination, are listed in the order of the file.
+using EdgeFrequencies =
+    std::map<std::pair<std::string, std::string>, std::vector<long long>>;
+
+/// \brief Reads the edge frequencies written by propagation with -o, such as
+/// a <function>.prof.full.edges file, and sums the runs appended to it.
+/// \param filename Path to the file.
+/// \param frequencies The count of each edge.
+/// \return false if the file could not be opened, or is malformed.
+bool readEdgeFrequencies(const std::string &filename,
+                         EdgeFrequencies &frequencies);
+
+/// \brief Parses the records of a binary profile, and sums their counters.
+/// \param buffer The contents of the profile.
+/// \param functionProfiles Maps each function's name to the pairs of edge
+/// index and count of its counters, sorted by edge index.
+/// \return false if the profile is malformed.
+bool parseBinaryProfile(const std::string &buffer,
+                        std::map<std::string, EdgeCounts> &functionProfiles);
+
+/// \brief Parses the records of a binary profile, and sums the counters of
+/// the records of each module.
+/// \param buffer The contents of the profile.
+/// \param moduleProfiles The profiles of the modules.
+/// \return false if the profile is malformed.
+bool parseBinaryProfile(const std::string &buffer,
+                        ModuleProfiles &moduleProfiles);
+
+/// \brief The sums of the counters of several profiles: maps the hash of the
+/// module and the name of each function to the count of each of its edge
+/// indices. Functions of different programs may share a name, but not their
+/// edge indices.
+using ProfileSums = std::map<std::pair<uint64_t, std::string>,
+                             std::map<long long, long long>>;
+
+/// \brief Adds the counters of the profile of a module to a sum of profiles.
+/// \param sums The sum of profiles.
+/// \param functionProfiles The profile to add.
+/// \param module The hash of the module, or 0 if it is unknown, as for text
+/// profiles.
+void addProfile(ProfileSums &sums,
+                const std::map<std::string, EdgeCounts> &functionProfiles,
+                uint64_t module = 0);
+
+/// \brief Adds the counters of the profiles of several modules to a sum of
+/// profiles.
+/// \param sums The sum of profiles.
+/// \param moduleProfiles The profiles to add.
+void addProfile(ProfileSums &sums, const ModuleProfiles &moduleProfiles);
+
+/// \brief Builds a binary profile, as described in NisseProfile.h, with one
+/// record per module.
+/// \param sums The counts of each edge of each function.
+/// \return The records.
+std::string buildBinaryProfile(const ProfileSums &sums);
+
+/// \brief The increase of the counters over one interval of a snapshot file.
+struct Snapshot {
+  uint64_t sequence; ///< The number of the snapshot, starting from 1.
+  uint64_t timeNs;   ///< Time of the snapshot, since the program started.
+  /// Maps each function's name to the pairs of edge index and increase of its
+  /// counters, sorted by edge index.
+  std::map<std::string, EdgeCounts> functionProfiles;
+};
+
+/// \brief Checks if a file is a snapshot file.
+/// \param filename Path to the file.
+/// \return true if the file starts with the snapshot magic.
+bool isSnapshotFile(const std::string &filename);
+
+/// \brief Reads the records left in the ring buffer of a snapshot file, from
+/// the oldest to the newest.
+/// \param filename Path to the snapshot file.
+/// \param snapshots The snapshots read.
+/// \return false if the file is malformed.
+bool readSnapshots(const std::string &filename,
+                   std::vector<Snapshot> &snapshots);
+
+} // namespace nisse
+
+#endif
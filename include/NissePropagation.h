@@ -0,0 +1,144 @@
+//===-- NissePropagation.h --------------------------------*- C++ -*-===//
+// Copyright (C) 2023 Leon Frenot
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// This file contains the declarations of the routines that reconstruct the
+/// weights of all the edges of a function from the weights of its
+/// instrumented edges, which are shared by the tools.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef NISSE_PROPAGATION_H
+#define NISSE_PROPAGATION_H
+
+#include <istream>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace nisse {
+
+/// \brief Shorthand for long long int
+using ll = long long int;
+/// \brief Shorthand for vector of long long int.
+using vi = std::vector<ll>;
+/// \brief Shorthand for vector of vector of long long int.
+using vvi = std::vector<vi>;
+/// \brief Shorthand for vector of pairs of long long int.
+using vpi = std::vector<std::pair<ll, ll>>;
+/// \brief Shorthand for set of long long int.
+using si = std::set<ll>;
+/// \brief Shorthand for map from int to set of long long int.
+using msi = std::map<ll, si>;
+
+using vs = std::vector<std::string>;
+using mss = std::map<std::string, si>;
+using vps = std::vector<std::pair<std::string, std::string>>;
+
+/// \brief Initialises the variables given as input with the graph described by
+/// the file input.
+/// \param input Path to the input file.
+/// \param vertex The graph's vertices.
+/// \param edges The graph's edges.
+/// \param ST A spanning tree of the graph.
+/// \param revST The edges not in the spanning tree.
+/// \param in in[x] contains the edges towards x.
+/// \param out out[x] contains the edges from x.
+/// \param debug Flag for the debug messages.
+void initGraph(std::string input, vs &vertex, vps &edges, si &ST, si &revST,
+               mss &in, mss &out, bool debug);
+
+/// \brief Initialises the variables given as input with the graph read from a
+/// stream, in the format of the .graph files.
+/// \param graph The stream to read from.
+/// \param vertex The graph's vertices.
+/// \param edges The graph's edges.
+/// \param ST A spanning tree of the graph.
+/// \param revST The edges not in the spanning tree.
+/// \param in in[x] contains the edges towards x.
+/// \param out out[x] contains the edges from x.
+/// \param debug Flag for the debug messages.
+void readGraph(std::istream &graph, vs &vertex, vps &edges, si &ST, si &revST,
+               mss &in, mss &out, bool debug);
+
+/// \brief Initialises the edge weights based on the input file. If there are
+/// multiple profilings, will sum each of them to get the total profile.
+/// \param input Path to the input file.
+/// \param edgeCount Number of edges in the graph.
+/// \param instCount Number of instrumented edges.
+/// \param debug Flag for the debug messages.
+/// \return The weights of the edges, initialized at 0, or at the total value
+/// given in the input file.
+vi initWeights(std::string input, vpi &prof, int edgeCount, int instCount,
+               bool debug);
+
+/// \brief Propagates the weights across the entire graph.
+/// \param edges The graph's edges.
+/// \param ST The graph's spanning tree (edges that have not been instrumented).
+/// \param in in[x] contains the edges towards x.
+/// \param out out[x] contains the edges from x.
+/// \param weights The edge's weights.
+/// \param v The vertex to propagate from.
+/// \param e The edge to propagate from (not used on the initial call to the
+/// function).
+void propagation(vps &edges, si &ST, mss &in, mss &out, vi &weights,
+                 std::string v, int e = -1);
+
+/// \brief Propagates the weights across the entire graph, whose spanning tree
+/// may be a forest when the edges out of dispatch blocks are all counted.
+/// \param vertex The graph's vertices.
+/// \param edges The graph's edges.
+/// \param ST The graph's spanning forest (edges that have not been
+/// instrumented).
+/// \param in in[x] contains the edges towards x.
+/// \param out out[x] contains the edges from x.
+/// \param weights The edge's weights.
+void propagateForest(vs &vertex, vps &edges, si &ST, mss &in, mss &out,
+                     vi &weights);
+
+/// \brief Reconstructs the weights of all the edges of a function, from the
+/// counts of its instrumented edges and its .graph file.
+/// \param function The function's name.
+/// \param prof The pairs of edge index and count of the function's counters.
+/// \param edges The function's edges, filled by the call.
+/// \return The weights of the edges.
+vi propagateFunction(const std::string &function, vpi &prof, vps &edges);
+
+/// \brief Reconstructs the weights of all the edges of a function, from the
+/// counts of its instrumented edges and its graph.
+/// \param graph The graph of the function, in the format of the .graph files.
+/// \param prof The pairs of edge index and count of the function's counters.
+/// \param edges The function's edges, filled by the call.
+/// \return The weights of the edges.
+vi propagateGraph(std::istream &graph, vpi &prof, vps &edges);
+
+/// \brief Outputs the weights of the edges to the standard output.
+/// \param edges The graph's edges.
+/// \param weights The edge's weights.
+void outputCout(vps &edges, vi &weights);
+
+/// \brief Outputs the weights of the edges to the file given as input.
+/// \param filename The path to the file to write the results.
+/// \param edges The graph's edges.
+/// \param weights The edge's weights.
+void outputFile(std::string filename, vps &edges, vi &weights);
+
+} // namespace nisse
+
+#endif
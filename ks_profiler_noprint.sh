@@ -67,7 +67,7 @@ $LLVM_OPT -S -passes="dot-cfg" -stats \
 # Compile the newly instrumented program, and link it against the profiler.
 # We are passing -no_pie to disable address space layout randomization:
 #
-$LLVM_CLANG -Wall -std=c99 $PF_NAME $PROFILER_IMPL -o $BS_NAME
+$LLVM_CLANG -Wall -std=c99 -pthread -I$SOURCE_DIR/include $PF_NAME $PROFILER_IMPL -o $BS_NAME
 ret_code=$?
 if [[ $ret_code -ne 0 ]]; then
   echo "Compilation failed"
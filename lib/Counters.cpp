@@ -0,0 +1,96 @@
+//===-- Counters.cpp --------------------------------------------------===//
+// Copyright (C) 2023 Leon Frenot
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// This file contains the implementation of the Counters
+///
+//===----------------------------------------------------------------------===//
+
+#include "Nisse.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+using namespace llvm;
+using namespace std;
+
+namespace nisse {
+
+/// \brief Adds a value to a slot of an array of i64.
+static void createWideIncr(IRBuilder<> &builder, Value *array, CounterMode mode,
+                           Value *i, Value *incr) {
+  auto *L = builder.getInt64Ty();
+  Value *indexList[] = {i};
+  auto slot = builder.CreateGEP(L, array, indexList);
+
+  if (mode == CounterMode::Atomic) {
+    builder.CreateAtomicRMW(AtomicRMWInst::Add, slot, incr, MaybeAlign(8),
+                            AtomicOrdering::Monotonic);
+  } else {
+    auto value = builder.CreateLoad(L, slot);
+    builder.CreateStore(builder.CreateAdd(value, incr), slot);
+  }
+}
+
+void Counters::createIncr(IRBuilder<> &builder, int i, Value *incr) const {
+  this->createIncr(builder, builder.getInt64(i), incr);
+}
+
+void Counters::createIncr(IRBuilder<> &builder, Value *i, Value *incr) const {
+  if (this->spill) {
+    // Adds the low half of incr to the 32-bit slot, and keeps the carry out
+    // of it, plus the high half of incr, for the spill array.
+    auto *W = builder.getInt32Ty();
+    auto *L = builder.getInt64Ty();
+    Value *indexList[] = {i};
+    auto slot = builder.CreateGEP(W, this->array, indexList);
+    auto low = builder.CreateTrunc(incr, W);
+
+    Value *value;
+    if (this->mode == CounterMode::Atomic) {
+      value = builder.CreateAtomicRMW(AtomicRMWInst::Add, slot, low,
+                                      MaybeAlign(4), AtomicOrdering::Monotonic);
+    } else {
+      value = builder.CreateLoad(W, slot);
+      builder.CreateStore(builder.CreateAdd(value, low), slot);
+    }
+
+    auto sum = builder.CreateAdd(builder.CreateZExt(value, L),
+                                 builder.CreateZExt(low, L));
+    auto carry = builder.CreateAdd(builder.CreateLShr(incr, 32),
+                                   builder.CreateLShr(sum, 32), "carry");
+    auto cond = builder.CreateICmpNE(carry, builder.getInt64(0));
+    this->overflows.push_back({cast<Instruction>(cond), i});
+    return;
+  }
+
+  createWideIncr(builder, this->array, this->mode, i, incr);
+}
+
+void Counters::insertOverflowSpills() const {
+  for (auto [cond, i] : this->overflows) {
+    auto &Ctx = cond->getContext();
+    auto weights = MDBuilder(Ctx).createBranchWeights(1, 1 << 20);
+    auto then =
+        SplitBlockAndInsertIfThen(cond, cond->getNextNode(), false, weights);
+    IRBuilder<> builder(then);
+    auto carry = cond->getOperand(0);
+    createWideIncr(builder, this->spill, this->mode, i, carry);
+  }
+  this->overflows.clear();
+}
+
+} // namespace nisse
@@ -21,6 +21,7 @@
 //===----------------------------------------------------------------------===//
 
 #include "Nisse.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include <iostream>
 
 using namespace llvm;
@@ -36,9 +37,14 @@ void Edge::setSESE(llvm::Value *indVar, llvm::Value *initValue,
                    const llvm::APInt *incrValue,
                    llvm::SmallVector<BlockPtr> &exitBlocks, int weight) {
   auto incr = incrValue->signedRoundToDouble();
-  if (this->flagSESE &&
+  if (this->tripCount)
+    return;
+  if (this->flagSESE && !this->stride &&
       (this->incrValue == 1 || abs(this->incrValue) < abs(incr)))
     return;
+  this->stride = nullptr;
+  this->stridePreheader = nullptr;
+  this->invariantCondition = nullptr;
   this->indVar = indVar;
   this->initValue = initValue;
   this->incrValue = incr;
@@ -47,7 +53,106 @@ void Edge::setSESE(llvm::Value *indVar, llvm::Value *initValue,
   this->flagSESE = true;
 }
 
-bool Edge::isSESE() { return this->flagSESE; }
+bool Edge::isSESE() const { return this->flagSESE; }
+
+void Edge::setStridedSESE(llvm::Value *indVar, llvm::Value *initValue,
+                          const SCEV *stride, BlockPtr preheader,
+                          llvm::SmallVector<BlockPtr> &exitBlocks) {
+  if (this->flagSESE)
+    return;
+  this->indVar = indVar;
+  this->initValue = initValue;
+  this->incrValue = 0;
+  this->stride = stride;
+  this->stridePreheader = preheader;
+  this->exitBlocks = exitBlocks;
+  this->weight = 0;
+  this->flagSESE = true;
+}
+
+void Edge::setInvariantBranch(llvm::Value *condition, bool whenTrue,
+                              bool exitsAtHeader) {
+  this->invariantCondition = condition;
+  this->invariantWhenTrue = whenTrue;
+  this->invariantExitsAtHeader = exitsAtHeader;
+}
+
+bool Edge::hasStride() const { return this->stride; }
+
+const SCEV *Edge::getStride() const { return this->stride; }
+
+BlockPtr Edge::getStridePreheader() const { return this->stridePreheader; }
+
+void Edge::setTripCount(const SCEV *tripCount, BlockPtr preheader,
+                        SmallVector<BlockPtr> &exitBlocks, bool atPreheader) {
+  this->tripCount = tripCount;
+  this->tripCountPreheader = preheader;
+  this->tripCountAtPreheader = atPreheader;
+  this->exitBlocks = exitBlocks;
+  this->weight = 0;
+  this->flagSESE = true;
+}
+
+bool Edge::hasTripCount() const { return this->tripCount; }
+
+const SCEV *Edge::getTripCount() const { return this->tripCount; }
+
+BlockPtr Edge::getTripCountPreheader() const {
+  return this->tripCountPreheader;
+}
+
+void Edge::setPromotionLoop(LoopInfo &LI) {
+  auto block = this->getInstrumentationPoint()->getParent();
+  Loop *inner = LI.getLoopFor(block);
+
+  // The block that a critical edge is split into is only in the loops that
+  // hold both of its ends.
+  if (this->isCritical())
+    while (inner && !(inner->contains(this->origin) &&
+                      inner->contains(this->dest)))
+      inner = inner->getParentLoop();
+
+  this->innermost = inner && inner->isInnermost();
+  for (Loop *L = inner; L; L = L->getParentLoop()) {
+    SmallVector<BlockPtr> exits;
+    L->getUniqueExitBlocks(exits);
+    if (!L->getLoopPreheader() || !L->hasDedicatedExits() || exits.empty())
+      continue;
+    this->loopPreheader = L->getLoopPreheader();
+    this->loopExits = exits;
+  }
+}
+
+bool Edge::isInInnermostLoop() const { return this->innermost; }
+
+bool Edge::isPromotable() const {
+  return this->loopPreheader && !this->flagSESE &&
+         !AnalysisUtil::isIndexedDispatch(this->origin) &&
+         !this->isCountedByAddress();
+}
+
+bool Edge::isCritical() const {
+  auto TI = this->origin->getTerminator();
+  return this->successor >= 0 && !isa<IndirectBrInst>(TI) &&
+         TI->getNumSuccessors() > 1 && !this->dest->hasNPredecessors(1);
+}
+
+void Edge::splitIfCritical() {
+  if (!this->isCritical())
+    return;
+  auto block = SplitCriticalEdge(this->origin->getTerminator(),
+                                 this->successor);
+  if (block) {
+    this->origin = block;
+    this->successor = 0;
+  }
+}
+
+bool Edge::isCountedByAddress() const {
+  return isa<IndirectBrInst>(this->origin->getTerminator()) &&
+         (AnalysisUtil::isIndirectDispatch(this->origin) ||
+          !this->dest->hasNPredecessors(1));
+}
 
 Instruction *Edge::getInstrumentationPoint() const {
   Instruction *instr;
@@ -64,16 +169,21 @@ Instruction *Edge::getInstrumentationPoint() const {
   return instr;
 }
 
-void Edge::insertSimpleIncrFn(int i, Value *inst) {
+void Edge::insertSimpleIncrFn(int i, const Counters &counters) {
+  this->splitIfCritical();
   auto instruction = this->getInstrumentationPoint();
   IRBuilder<> builder(instruction);
-  auto *L = builder.getInt64Ty();
-  Value *indexList[] = {builder.getInt64(i)};
   Value *incr = builder.getInt64(1);
-  auto inst1 = builder.CreateGEP(L, inst, indexList);
-  auto inst2 = builder.CreateLoad(L, inst1);
-  auto inst3 = builder.CreateAdd(inst2, incr);
-  builder.CreateStore(inst3, inst1);
+  counters.createIncr(builder, i, incr);
+}
+
+void Edge::insertAddressIncrFn(int i, const Counters &counters) {
+  auto IBI = cast<IndirectBrInst>(this->origin->getTerminator());
+  IRBuilder<> builder(IBI);
+  auto taken = builder.CreateICmpEQ(IBI->getAddress(),
+                                    BlockAddress::get(this->dest));
+  counters.createIncr(builder, i,
+                      builder.CreateZExt(taken, builder.getInt64Ty()));
 }
 
 Value *Edge::createInt32Cast(llvm::Value *inst, IRBuilder<> &builder) {
@@ -104,49 +214,126 @@ Value *Edge::createInt64Cast(llvm::Value *inst, IRBuilder<> &builder) {
   return inst;
 }
 
-void Edge::insertSESEIncrFn(int i, Value *inst) {
+void Edge::insertSESEIncrFn(int i, const Counters &counters, Value *stride) {
   for (auto block : this->exitBlocks) {
     Instruction *instruction = &*block->getFirstInsertionPt();
     IRBuilder<> builder(instruction);
-    Type *int64Ty = builder.getInt64Ty();
-    Value *indexList[] = {builder.getInt64(i)};
 
     auto incrValueCst = builder.getInt64(this->incrValue);
 
-    auto inst1 = builder.CreateGEP(int64Ty, inst, indexList);
-    auto inst = builder.CreateLoad(int64Ty, inst1);
     auto indVarCast = this->createInt64Cast(indVar, builder);
     auto initValueCast = this->createInt64Cast(initValue, builder);
+    // Induction variables often start at zero, which needs no subtraction.
+    auto *initConstant = dyn_cast<Constant>(initValue);
+    bool fromZero = initConstant && initConstant->isNullValue();
+    auto distance = [&]() {
+      return fromZero ? indVarCast
+                      : builder.CreateSub(indVarCast, initValueCast);
+    };
     Value *incr;
-    switch ((int)incrValue) {
-    case 1:
-      incr = builder.CreateSub(indVarCast, initValueCast);
-      break;
-
-    case -1:
-      incr = builder.CreateSub(initValueCast, indVarCast);
-      break;
-
-    default:
-      auto inst3 = builder.CreateSub(indVarCast, initValueCast);
-      auto incr0 = builder.CreateSDiv(inst3, incrValueCst);
-      incr = builder.CreateIntCast(incr0, builder.getInt64Ty(), true);
-      break;
+    if (stride) {
+      incr = builder.CreateExactSDiv(distance(), stride);
+    } else {
+      switch ((int)incrValue) {
+      case 1:
+        incr = distance();
+        break;
+
+      case -1:
+        incr = builder.CreateSub(initValueCast, indVarCast);
+        break;
+
+      default:
+        // The distance is a multiple of the step, e.g. the size of the elements
+        // of a pointer, which a power of two rescales with a shift.
+        auto inst3 = distance();
+        uint64_t step = abs((long long)incrValue);
+        if (isPowerOf2_64(step)) {
+          incr = builder.CreateAShr(inst3, Log2_64(step), "", true);
+          if (incrValue < 0)
+            incr = builder.CreateNeg(incr);
+        } else {
+          incr = builder.CreateExactSDiv(inst3, incrValueCst);
+        }
+        break;
+      }
     }
 
-    auto inst4 = builder.CreateAdd(inst, incr);
-    builder.CreateStore(inst4, inst1);
+    // The back edge is taken once less than the loop iterates, unless the
+    // loop exits at its header, and the invariant branch goes the same way in
+    // every iteration.
+    if (this->invariantCondition) {
+      Value *iterations =
+          this->invariantExitsAtHeader
+              ? incr
+              : builder.CreateAdd(incr, builder.getInt64(1));
+      Value *zero = builder.getInt64(0);
+      incr = this->invariantWhenTrue
+                 ? builder.CreateSelect(this->invariantCondition, iterations,
+                                        zero)
+                 : builder.CreateSelect(this->invariantCondition, zero,
+                                        iterations);
+    }
+
+    counters.createIncr(builder, i, incr);
+  }
+}
+
+void Edge::insertTripCountIncrFn(int i, const Counters &counters,
+                                 Value *count) {
+  if (this->tripCountAtPreheader) {
+    IRBuilder<> builder(this->tripCountPreheader->getTerminator());
+    counters.createIncr(builder, i, count);
+    return;
+  }
+  for (auto block : this->exitBlocks) {
+    IRBuilder<> builder(&*block->getFirstInsertionPt());
+    counters.createIncr(builder, i, count);
   }
 }
 
-void Edge::insertIncrFn(int i, Value *inst) {
-  if (this->flagSESE) {
-    this->insertSESEIncrFn(i, inst);
+void Edge::insertStridedIncrFn(int i, const Counters &counters,
+                               Value *stride) {
+  this->insertSESEIncrFn(i, counters, stride);
+}
+
+AllocaInst *Edge::insertPromotedIncrFn(int i, const Counters &counters) {
+  this->splitIfCritical();
+  Function *F = this->origin->getParent();
+  IRBuilder<> builder(&*F->getEntryBlock().getFirstInsertionPt());
+  auto *L = builder.getInt64Ty();
+  auto local = builder.CreateAlloca(L, nullptr, "promoted-counter");
+
+  builder.SetInsertPoint(this->loopPreheader->getTerminator());
+  builder.CreateStore(builder.getInt64(0), local);
+
+  builder.SetInsertPoint(this->getInstrumentationPoint());
+  auto value = builder.CreateLoad(L, local);
+  builder.CreateStore(builder.CreateAdd(value, builder.getInt64(1)), local);
+
+  for (auto block : this->loopExits) {
+    builder.SetInsertPoint(&*block->getFirstInsertionPt());
+    counters.createIncr(builder, i, builder.CreateLoad(L, local));
+  }
+  return local;
+}
+
+void Edge::insertIncrFn(int i, const Counters &counters) {
+  if (this->isCountedByAddress()) {
+    this->insertAddressIncrFn(i, counters);
+  } else if (this->flagSESE) {
+    this->insertSESEIncrFn(i, counters);
   } else {
-    this->insertSimpleIncrFn(i, inst);
+    this->insertSimpleIncrFn(i, counters);
   }
 }
 
+BlockPtr Edge::getUpdateBlock() const {
+  if (this->flagSESE && !this->exitBlocks.empty())
+    return this->exitBlocks.front();
+  return this->getInstrumentationPoint()->getParent();
+}
+
 int Edge::getIndex() const { return this->index; }
 
 string Edge::getName() const { return to_string(this->index); }
@@ -23,19 +23,28 @@
 //===----------------------------------------------------------------------===//
 
 #include "Nisse.h"
+#include "NisseProfileReader.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/LoopPass.h"
 #include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Transforms/Scalar/LoopPassManager.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
 #include <fstream>
 #include <queue>
+#include <random>
+#include <sstream>
 #include <regex>
 
 #define DEBUG_TYPE "nisse" // This goes after any #includes.
@@ -43,6 +52,42 @@ STATISTIC(NumCounters, "The # of counters");
 STATISTIC(Loops, "The # of loops");
 STATISTIC(SESECounters, "The # of SESE counters found");
 STATISTIC(SESEUsed, "The # of SESE counters used");
+STATISTIC(TripCountCounters, "The # of trip-count counters found");
+STATISTIC(NestedTripCounts, "The # of trip counts summed over a parent loop");
+STATISTIC(InvariantBranchCounters,
+          "The # of edges out of loop-invariant branches counted at the exits");
+STATISTIC(SharedCounters, "The # of counters moved to an equivalent edge");
+
+static llvm::cl::opt<unsigned> DispatchCounters(
+    "nisse-dispatch-counters", llvm::cl::init(0),
+    llvm::cl::desc("Count the edges out of a switch with at least this many "
+                   "successors, or out of an indirectbr, with one indexed "
+                   "counter in the dispatch block (0 disables it)"),
+    llvm::cl::value_desc("successors"));
+
+static llvm::cl::opt<nisse::EdgeWeighting> EdgeWeights(
+    "nisse-edge-weights", llvm::cl::init(nisse::EdgeWeighting::Static),
+    llvm::cl::desc("How the edges are weighted to choose the ones that get "
+                   "no counter"),
+    llvm::cl::values(
+        clEnumValN(nisse::EdgeWeighting::Uniform, "uniform",
+                   "Every edge has the same weight"),
+        clEnumValN(nisse::EdgeWeighting::Static, "static",
+                   "Static estimates of the edge frequencies (default)"),
+        clEnumValN(nisse::EdgeWeighting::Profile, "profile",
+                   "The edge frequencies of a previous profile, given with "
+                   "-nisse-edge-profile")));
+
+static llvm::cl::opt<std::string> EdgeProfile(
+    "nisse-edge-profile", llvm::cl::init("%f.prof.full.edges"),
+    llvm::cl::desc("The edge frequencies used by -nisse-edge-weights=profile, "
+                   "where %f stands for the name of the function"),
+    llvm::cl::value_desc("filename"));
+
+static llvm::cl::opt<bool> VectorizerFriendly(
+    "nisse-vectorizer-friendly", llvm::cl::init(false),
+    llvm::cl::desc("Leave no counter update to memory inside innermost loops, "
+                   "so that the loop vectorizer still applies to them"));
 
 using namespace llvm;
 using namespace std;
@@ -94,18 +139,128 @@ AnalysisKey NisseAnalysis::Key;
 // Initialize the analysis key.
 AnalysisKey KSAnalysis::Key;
 
-multiset<Edge> AnalysisUtil::generateEdges(Function &F) {
+/// \brief Reads the counts of a function's edges in a previous profile, written
+/// by propagation in the file given with -nisse-edge-profile.
+/// \param F The function.
+/// \param counts The count of each edge, by index, the last one being the edge
+/// from the return block to the entry.
+/// \return false if the file could not be read, or if the CFG has changed.
+static bool readEdgeCounts(Function &F, vector<long long> &counts) {
+  string filename = EdgeProfile;
+  for (size_t at = filename.find("%f"); at != string::npos;
+       at = filename.find("%f", at)) {
+    filename.replace(at, 2, F.getName().str());
+    at += F.getName().size();
+  }
+  EdgeFrequencies frequencies;
+  if (!readEdgeFrequencies(filename, frequencies))
+    return false;
+
+  // The edges are matched by the names of their ends, in the order of the
+  // file for parallel edges, and each edge of the file must be matched.
+  map<pair<string, string>, size_t> seen;
+  auto match = [&](BasicBlock *origin, BasicBlock *dest) {
+    pair<string, string> key(AnalysisUtil::removebb(origin->getName().str()),
+                             AnalysisUtil::removebb(dest->getName().str()));
+    auto it = frequencies.find(key);
+    size_t n = seen[key]++;
+    if (it == frequencies.end() || n >= it->second.size())
+      return false;
+    counts.push_back(it->second[n]);
+    return true;
+  };
+  for (auto &BB : F) {
+    auto TI = BB.getTerminator();
+    for (unsigned n = 0; n < TI->getNumSuccessors(); n++)
+      if (!match(&BB, TI->getSuccessor(n)))
+        return false;
+  }
+  if (!match(AnalysisUtil::findReturnBlock(F), &F.getEntryBlock()))
+    return false;
+  for (auto &[key, count] : frequencies)
+    if (seen[key] != count.size())
+      return false;
+  return true;
+}
+
+multiset<Edge> AnalysisUtil::generateEdges(Function &F,
+                                           FunctionAnalysisManager &FAM) {
+  // The profile weights are the counts of a previous run, scaled down to fit
+  // in an int. A function whose CFG has changed since gets static weights.
+  EdgeWeighting weighting = EdgeWeights;
+  vector<long long> counts;
+  if (weighting == EdgeWeighting::Profile && !readEdgeCounts(F, counts)) {
+    errs() << "No previous profile matches the CFG of '" << F.getName()
+           << "'. Using static edge weights...\n";
+    weighting = EdgeWeighting::Static;
+  }
+  long long scale = 1;
+  for (long long count : counts)
+    scale = max(scale, count / (INT_MAX / 2) + 1);
+
+  // The static weights are the estimated frequencies of the edges, relative to
+  // the entry of the function, in 1/64ths, so that edges colder than the entry
+  // still differ. They saturate in deep loop nests.
+  BlockFrequencyInfo *BFI = nullptr;
+  BranchProbabilityInfo *BPI = nullptr;
+  if (weighting == EdgeWeighting::Static) {
+    BFI = &FAM.getResult<BlockFrequencyAnalysis>(F);
+    BPI = &FAM.getResult<BranchProbabilityAnalysis>(F);
+  }
+  auto getWeight = [&](BasicBlock *BB, unsigned n, int index) {
+    if (weighting == EdgeWeighting::Profile)
+      return (int)(max(0LL, counts[index]) / scale + 1);
+    if (!BFI)
+      return 1;
+    double frequency = (double)BFI->getBlockFreq(BB).getFrequency() /
+                       BFI->getEntryFreq();
+    BranchProbability probability = BPI->getEdgeProbability(BB, n);
+    double weight = frequency * probability.getNumerator() /
+                    probability.getDenominator() * 64;
+    return (int)max(1.0, min(weight, (double)INT_MAX));
+  };
+
   multiset<Edge> edges;
   int index = 0;
   for (auto &BB : F) {
-    for (auto Succ : successors(&BB)) {
-      edges.insert(Edge(&BB, Succ, index++));
+    auto TI = BB.getTerminator();
+    for (unsigned n = 0; n < TI->getNumSuccessors(); n++) {
+      edges.insert(Edge(&BB, TI->getSuccessor(n), index,
+                        getWeight(&BB, n, index), n));
+      index++;
     }
   }
   edges.insert(Edge(findReturnBlock(F), &F.getEntryBlock(), index++, 0));
   return edges;
 }
 
+bool AnalysisUtil::isIndexedDispatch(const BasicBlock *BB) {
+  auto SI = dyn_cast<SwitchInst>(BB->getTerminator());
+  if (!DispatchCounters || !SI || SI->getNumSuccessors() < DispatchCounters)
+    return false;
+  if (SI->getCondition()->getType()->getIntegerBitWidth() > 64)
+    return false;
+
+  // The case values must be dense enough for a table of slots indexed by
+  // their offset from the smallest one.
+  APInt low = SI->case_begin()->getCaseValue()->getValue(), high = low;
+  for (auto Case : SI->cases()) {
+    const APInt &value = Case.getCaseValue()->getValue();
+    if (value.slt(low))
+      low = value;
+    if (value.sgt(high))
+      high = value;
+  }
+  APInt range = high - low;
+  return range.ult(10 * (uint64_t)SI->getNumCases());
+}
+
+bool AnalysisUtil::isVectorizerFriendly() { return VectorizerFriendly; }
+
+bool AnalysisUtil::isIndirectDispatch(const BasicBlock *BB) {
+  return DispatchCounters && isa<IndirectBrInst>(BB->getTerminator());
+}
+
 pair<multiset<Edge>, multiset<Edge>>
 AnalysisUtil::generateSTrev(Function &F, multiset<Edge> &edges) {
   multiset<Edge> ST;
@@ -114,24 +269,148 @@ AnalysisUtil::generateSTrev(Function &F, multiset<Edge> &edges) {
   for (auto &BB : F) {
     uf.init(&BB);
   }
-  multiset<Edge, greater<Edge>> revEdges(edges.begin(), edges.end());
-  for (auto e : revEdges) {
+
+  // The edges out of an indexed dispatch are all counted by its counter, so
+  // they are kept out of the tree, which may then only span a forest. The
+  // edges out of an indirectbr cannot be split, so they go in the tree first,
+  // and those left out are counted by comparing the target address.
+  vector<Edge> order;
+  for (auto &e : edges)
+    if (isIndirectDispatch(e.getOrigin()))
+      order.push_back(e);
+  multiset<Edge, greater<Edge>> revEdges;
+  for (auto &e : edges)
+    if (!isIndirectDispatch(e.getOrigin()))
+      revEdges.insert(e);
+  order.insert(order.end(), revEdges.begin(), revEdges.end());
+
+  for (auto e : order) {
     auto BB1 = e.getOrigin();
     auto BB2 = e.getDest();
-    if (!uf.connected(BB1, BB2)) {
+    if (!uf.connected(BB1, BB2) && !isIndexedDispatch(BB1)) {
       ST.insert(e);
       uf.merge(BB1, BB2);
     } else {
-      NumCounters++;
-      if (e.isSESE()) {
-        SESEUsed++;
-      }
       rev.insert(e);
     }
   }
+  shareEquivalentCounters(F, ST, rev);
+
+  // Counted once the counters have moved to their equivalent edges.
+  for (auto &e : rev) {
+    NumCounters++;
+    if (e.isSESE()) {
+      SESEUsed++;
+    }
+  }
   return pair(ST, rev);
 }
 
+map<int, uint64_t>
+AnalysisUtil::identifyEquivalentEdges(Function &F, const multiset<Edge> &ST,
+                                      const multiset<Edge> &rev) {
+  // Each edge out of the tree closes one cycle of a basis of the cycle space,
+  // and gets a random label. The class of a tree edge is the xor of the labels
+  // of the cycles through it, i.e. of the edges out of the tree with one end
+  // below it, so that edges in the same cycles have the same class.
+  mt19937_64 random(F.size());
+  map<int, uint64_t> classes;
+  map<BasicBlock *, uint64_t> labels;
+  for (auto &e : rev) {
+    uint64_t label = random() | 1;
+    classes[e.getIndex()] = label;
+    labels[e.getOrigin()] ^= label;
+    labels[e.getDest()] ^= label;
+  }
+
+  // The tree, which may be a forest, is walked breadth first from each root,
+  // and the labels are summed from the leaves up.
+  map<BasicBlock *, vector<const Edge *>> adjacent;
+  for (auto &e : ST) {
+    adjacent[e.getOrigin()].push_back(&e);
+    adjacent[e.getDest()].push_back(&e);
+  }
+  set<BasicBlock *> visited;
+  vector<pair<BasicBlock *, const Edge *>> order;
+  for (auto &BB : F) {
+    if (!visited.insert(&BB).second)
+      continue;
+    order.push_back({&BB, nullptr});
+    for (size_t i = order.size() - 1; i < order.size(); i++) {
+      BasicBlock *block = order[i].first;
+      for (auto *e : adjacent[block]) {
+        auto other = e->getOrigin() == block ? e->getDest() : e->getOrigin();
+        if (visited.insert(other).second)
+          order.push_back({other, e});
+      }
+    }
+  }
+  for (auto it = order.rbegin(); it != order.rend(); ++it) {
+    auto [block, e] = *it;
+    if (!e)
+      continue;
+    classes[e->getIndex()] = labels[block];
+    auto parent = e->getOrigin() == block ? e->getDest() : e->getOrigin();
+    labels[parent] ^= labels[block];
+  }
+  return classes;
+}
+
+void AnalysisUtil::shareEquivalentCounters(Function &F, multiset<Edge> &ST,
+                                           multiset<Edge> &rev) {
+  // Equivalent edges have the same count only if the flow is conserved in
+  // every block, which a second block with no successor breaks.
+  int sinks = 0;
+  for (auto &BB : F)
+    sinks += succ_empty(&BB);
+  if (sinks > 1)
+    return;
+
+  // A critical edge must be split, and an edge out of an indirectbr may need
+  // a comparison. Well-founded counters are cheaper still, and are kept.
+  auto getCost = [](const Edge &e) {
+    if (e.isSESE())
+      return -1;
+    if (e.isCritical())
+      return 2;
+    return e.isCountedByAddress() ? 1 : 0;
+  };
+
+  auto classes = identifyEquivalentEdges(F, ST, rev);
+  map<uint64_t, vector<Edge>> members;
+  for (auto &e : ST)
+    if (classes[e.getIndex()] && !isIndirectDispatch(e.getOrigin()))
+      members[classes[e.getIndex()]].push_back(e);
+
+  vector<pair<Edge, Edge>> swaps;
+  for (auto &e : rev) {
+    auto it = members.find(classes[e.getIndex()]);
+    if (it == members.end() || isIndexedDispatch(e.getOrigin()))
+      continue;
+    const Edge *best = &e;
+    for (auto &t : it->second)
+      if (getCost(t) < getCost(*best))
+        best = &t;
+    if (best != &e)
+      swaps.push_back({e, *best});
+  }
+
+  auto erase = [](multiset<Edge> &edges, const Edge &e) {
+    for (auto it = edges.begin(); it != edges.end(); ++it)
+      if (it->getIndex() == e.getIndex()) {
+        edges.erase(it);
+        return;
+      }
+  };
+  for (auto &[counted, tree] : swaps) {
+    erase(rev, counted);
+    erase(ST, tree);
+    rev.insert(tree);
+    ST.insert(counted);
+    SharedCounters++;
+  }
+}
+
 bool NisseAnalysis::IsSESERegion(const BlockPtr &B1, const BlockPtr &B2) {
   if (!((DT.dominates(B1, B2) && PDT.dominates(B2, B1)) ||
         (PDT.dominates(B1, B2) && DT.dominates(B2, B1))))
@@ -150,25 +429,69 @@ void NisseAnalysis::initFunctionInfo(Function &F,
   this->CI.compute(F);
 }
 
+/// \brief Checks that a loop-invariant value is not zero when a loop is
+/// entered, e.g. because the loop is guarded by a test of the value. Extensions
+/// and products that do not overflow are looked through, as strides are often
+/// scaled by the size of the elements.
+/// \param SE The function's scalar evolution.
+/// \param L The loop.
+/// \param S The value.
+/// \return true if the value is known not to be zero.
+static bool isNonZeroAtEntry(ScalarEvolution &SE, const Loop *L,
+                             const SCEV *S) {
+  if (SE.isKnownNonZero(S) ||
+      SE.isLoopEntryGuardedByCond(L, ICmpInst::ICMP_NE, S,
+                                  SE.getZero(S->getType())))
+    return true;
+  if (isa<SCEVSignExtendExpr>(S) || isa<SCEVZeroExtendExpr>(S))
+    return isNonZeroAtEntry(SE, L, cast<SCEVCastExpr>(S)->getOperand());
+  if (auto *Mul = dyn_cast<SCEVMulExpr>(S))
+    return Mul->getNumOperands() == 2 &&
+           (Mul->hasNoSignedWrap() || Mul->hasNoUnsignedWrap() ||
+            SE.willNotOverflow(Instruction::Mul, true, Mul->getOperand(0),
+                               Mul->getOperand(1))) &&
+           isNonZeroAtEntry(SE, L, Mul->getOperand(0)) &&
+           isNonZeroAtEntry(SE, L, Mul->getOperand(1));
+  return false;
+}
+
+/// \brief Checks that the step of an induction variable can divide the
+/// distance it covers at the exits of its loop: it is a constant, or a
+/// loop-invariant value computed in the preheader, which must not be zero.
+/// \param SE The function's scalar evolution.
+/// \param L The loop.
+/// \param step The step.
+/// \return true if the step can be used.
+static bool isUsableStep(ScalarEvolution &SE, const Loop *L,
+                         const SCEV *step) {
+  if (isa<SCEVConstant>(step))
+    return true;
+  BlockPtr preheader = L->getLoopPreheader();
+  return preheader && SE.isLoopInvariant(step, L) &&
+         isSafeToExpandAt(step, preheader->getTerminator(), SE) &&
+         isNonZeroAtEntry(SE, L, step);
+}
+
 bool NisseAnalysis::identifyInductionVariable(
     ScalarEvolution &SE, multiset<Edge> &edges, PHINode *PHI,
     BlockPtr incomingBlock, BlockPtr backBlock, Edge &backEdge,
     SmallVector<BlockPtr> &exitBlocks) {
   if (!SE.isSCEVable(PHI->getType()))
     return false;
+  // Pointers are induction variables too: their step is in bytes.
   const SCEV *SCEV_PHI = SE.getSCEV(PHI);
-  if (!SE.containsAddRecurrence(SCEV_PHI))
-    return false;
-  const SCEVAddRecExpr *AddRecExpr = cast<SCEVAddRecExpr>(SCEV_PHI);
-  if (!AddRecExpr->isAffine())
+  const SCEVAddRecExpr *AddRecExpr = dyn_cast<SCEVAddRecExpr>(SCEV_PHI);
+  if (!AddRecExpr || !AddRecExpr->isAffine() ||
+      AddRecExpr->getLoop()->getHeader() != PHI->getParent())
     return false;
   // Affine induction variable found
   Value *IndVar = PHI;
   const SCEV *IncrementSCEV = AddRecExpr->getStepRecurrence(SE);
   const SCEVConstant *IncrementSCEVCst = dyn_cast<SCEVConstant>(IncrementSCEV);
-  if (!IncrementSCEVCst)
+  const Loop *L = AddRecExpr->getLoop();
+  BlockPtr preheader = L->getLoopPreheader();
+  if (!isUsableStep(SE, L, IncrementSCEV))
     return false;
-  const APInt *IncrementValue = &IncrementSCEVCst->getValue()->getValue();
   auto val = PHI->getIncomingValueForBlock(incomingBlock);
   for (auto it = edges.begin(); it != edges.end(); ) {
     if (*it == backEdge) {
@@ -176,7 +499,12 @@ bool NisseAnalysis::identifyInductionVariable(
       it = edges.erase(it);
 
       Edge newEdge = oldEdge;
-      newEdge.setSESE(IndVar, val, IncrementValue, exitBlocks);
+      if (IncrementSCEVCst)
+        newEdge.setSESE(IndVar, val, &IncrementSCEVCst->getAPInt(),
+                        exitBlocks);
+      else
+        newEdge.setStridedSESE(IndVar, val, IncrementSCEV, preheader,
+                               exitBlocks);
       edges.insert(newEdge);
 
       return true;
@@ -187,13 +515,71 @@ bool NisseAnalysis::identifyInductionVariable(
   return false;
 }
 
-bool NisseAnalysis::identifyBranchVariable(ScalarEvolution &SE,
+/// \brief Finds the constant by which an instruction moves one of its operands,
+/// as ScalarEvolution sees it. This covers additions and subtractions of a
+/// constant, disjoint ors, and geps with constant offsets.
+/// \param SE The function's scalar evolution.
+/// \param I The instruction.
+/// \param operand Set to the operand that the instruction moves.
+/// \return The constant, or nullptr.
+static const SCEVConstant *getConstantStep(ScalarEvolution &SE, Instruction *I,
+                                           Value *&operand) {
+  if (!SE.isSCEVable(I->getType()))
+    return nullptr;
+  SmallVector<Value *, 2> candidates;
+  if (auto *GEP = dyn_cast<GetElementPtrInst>(I))
+    candidates.push_back(GEP->getPointerOperand());
+  else if (isa<BinaryOperator>(I))
+    candidates.append(I->op_begin(), I->op_end());
+  for (Value *candidate : candidates) {
+    if (isa<Constant>(candidate) || !SE.isSCEVable(candidate->getType()))
+      continue;
+    const SCEV *step =
+        SE.getMinusSCEV(SE.getSCEV(I), SE.getSCEV(candidate));
+    if (auto *constant = dyn_cast<SCEVConstant>(step)) {
+      operand = candidate;
+      return constant;
+    }
+  }
+  return nullptr;
+}
+
+/// \brief Checks that the blocks of a loop can only run again after the loop
+/// went through its header, and not before it exits, so that a variable that
+/// they modify already holds each of its modifications at the exits.
+/// \param L The loop.
+/// \param blocks The blocks.
+/// \return true if no exiting block is reachable from the blocks within an
+/// iteration.
+static bool isModifiedAfterExits(Loop *L, set<BlockPtr> &blocks) {
+  SmallVector<BlockPtr> exiting;
+  L->getExitingBlocks(exiting);
+  set<BlockPtr> visited;
+  queue<BlockPtr> queue;
+  for (auto block : blocks)
+    queue.push(block);
+  while (!queue.empty()) {
+    auto block = queue.front();
+    queue.pop();
+    if (!visited.insert(block).second)
+      continue;
+    if (find(exiting.begin(), exiting.end(), block) != exiting.end())
+      return false;
+    for (auto succ : successors(block))
+      if (succ != L->getHeader() && L->contains(succ))
+        queue.push(succ);
+  }
+  return true;
+}
+
+bool NisseAnalysis::identifyBranchVariable(Loop *L, ScalarEvolution &SE,
                                            multiset<Edge> &edges, PHINode *PHI,
                                            BlockPtr incomingBlock,
                                            BlockPtr backBlock,
                                            SmallVector<BlockPtr> &exitBlocks) {
-  long value = 0;
+  APInt value(64, 0);
   set<Value *> definitions;
+  set<BlockPtr> opBlocks;
   queue<Value *> queue;
   BlockPtr opBlock = nullptr;
   Edge *edge = nullptr;
@@ -204,66 +590,55 @@ bool NisseAnalysis::identifyBranchVariable(ScalarEvolution &SE,
     queue.pop();
     if (definitions.count(val) == 0) {
       definitions.insert(val);
-      bool flag = true;
       if (auto *PHI = dyn_cast<PHINode>(val)) {
-        flag = false;
         for (unsigned int i = 0; i < PHI->getNumIncomingValues(); i++) {
           queue.push(PHI->getIncomingValue(i));
         }
+        continue;
       }
-      if (auto *BIN = dyn_cast<BinaryOperator>(val)) {
-        if (!(BIN->getOpcode() == Instruction::Add ||
-              BIN->getOpcode() == Instruction::Sub)) {
+      auto *I = dyn_cast<Instruction>(val);
+      Value *operand = nullptr;
+      const SCEVConstant *step = I ? getConstantStep(SE, I, operand) : nullptr;
+      if (!step || !L->contains(I))
+        return false;
+      if (opBlock != nullptr) {
+        if (!IsSESERegion(opBlock, I->getParent())) {
           return false;
         }
-        flag = false;
-        int constantOp = -1;
-        int constantVal = 0;
-        for (auto i = 0; i < 2; i++) {
-          Value *operand = BIN->getOperand(i);
-          if (ConstantInt *constant = dyn_cast<ConstantInt>(operand)) {
-            if (constantOp != -1) {
-              return false;
-            }
-            constantOp = i;
-            constantVal = constant->getValue().getSExtValue();
-          }
-        }
-        if (constantOp != -1) {
-          if (opBlock != nullptr) {
-            if (!IsSESERegion(opBlock, BIN->getParent())) {
-              return false;
-            }
-          } else
-            opBlock = BIN->getParent();
-          value += constantVal;
-          queue.push(BIN->getOperand(1 - constantOp));
-          if (edge == nullptr) {
-            BlockPtr block = BIN->getParent();
-            if (BlockPtr pred = block->getUniquePredecessor()) {
-              edge = new Edge(pred, block, -1);
-            } else {
-              if (BlockPtr succ = block->getUniqueSuccessor()) {
-                edge = new Edge(block, succ, -1);
-              }
-            }
+      } else
+        opBlock = I->getParent();
+      opBlocks.insert(I->getParent());
+      value += step->getAPInt().sextOrTrunc(64);
+      queue.push(operand);
+      if (edge == nullptr) {
+        BlockPtr block = I->getParent();
+        if (BlockPtr pred = block->getUniquePredecessor()) {
+          edge = new Edge(pred, block, -1);
+        } else {
+          if (BlockPtr succ = block->getUniqueSuccessor()) {
+            edge = new Edge(block, succ, -1);
           }
         }
       }
-      if (flag) {
-        return false;
-      }
     }
   }
   if (edge == nullptr || value == 0) {
     return false;
   }
+  // The header's PHI misses the modifications of the last iteration, which
+  // are still in the value going to the back edge when the loop exits from its
+  // latch only, as rotated loops do.
+  Value *exitValue = PHI;
+  if (L->getExitingBlock() == backBlock)
+    exitValue = PHI->getIncomingValueForBlock(backBlock);
+  else if (!isModifiedAfterExits(L, opBlocks))
+    return false;
   for (auto &e : edges) {
     if (e == *edge) {
       edges.erase(e);
       Edge new_e = e;
-      new_e.setSESE(PHI, PHI->getIncomingValueForBlock(incomingBlock),
-                    new APInt(64, value, true), exitBlocks);
+      new_e.setSESE(exitValue, PHI->getIncomingValueForBlock(incomingBlock),
+                    new APInt(value), exitBlocks);
       edges.insert(new_e);
       return true;
     }
@@ -271,40 +646,246 @@ bool NisseAnalysis::identifyBranchVariable(ScalarEvolution &SE,
   return false;
 }
 
+const SCEV *NisseAnalysis::sumOverParentLoop(Loop *L, const SCEV *count,
+                                             ScalarEvolution &SE) {
+  Loop *P = L->getParentLoop();
+  if (!P)
+    return nullptr;
+  BlockPtr preheader = P->getLoopPreheader();
+  BlockPtr latch = P->getLoopLatch();
+  BlockPtr exiting = P->getExitingBlock();
+  if (!preheader || !latch || !P->hasDedicatedExits() ||
+      (exiting != latch && exiting != P->getHeader()))
+    return nullptr;
+
+  // L runs once per iteration of P if its preheader is in no other subloop of
+  // P, and is on every path from the header of P to its latch. P iterates once
+  // more than it takes its back edge if it exits at the latch, and as many
+  // times if it exits at the header, before the body runs.
+  Loop *around = LI.getLoopFor(L->getLoopPreheader());
+  if (!around || around->getHeader() != P->getHeader() ||
+      !DT.dominates(L->getLoopPreheader(), latch))
+    return nullptr;
+
+  const SCEV *iterations = SE.getBackedgeTakenCount(P);
+  if (isa<SCEVCouldNotCompute>(iterations) ||
+      iterations->getType()->getIntegerBitWidth() > 64)
+    return nullptr;
+  Type *I64 = Type::getInt64Ty(P->getHeader()->getContext());
+  iterations = SE.getNoopOrZeroExtend(iterations, I64);
+  if (exiting == latch)
+    iterations = SE.getAddExpr(iterations, SE.getOne(I64));
+
+  // If count is {c0,+,c1,+,...}<P> at the k-th iteration of P, the sum of its
+  // values over the first n iterations is {0,+,c0,+,c1,+,...}<P> at the n-th.
+  count = SE.getNoopOrZeroExtend(count, I64);
+  SmallVector<const SCEV *> operands = {SE.getZero(I64)};
+  auto *AddRec = dyn_cast<SCEVAddRecExpr>(count);
+  if (AddRec && AddRec->getLoop() == P)
+    operands.append(AddRec->op_begin(), AddRec->op_end());
+  else if (SE.isLoopInvariant(count, P))
+    operands.push_back(count);
+  else
+    return nullptr;
+  const SCEV *sum = SE.getAddRecExpr(operands, P, SCEV::FlagAnyWrap);
+  if (auto *SumRec = dyn_cast<SCEVAddRecExpr>(sum))
+    sum = SumRec->evaluateAtIteration(iterations, SE);
+  if (isa<SCEVCouldNotCompute>(sum) ||
+      !isSafeToExpandAt(sum, preheader->getTerminator(), SE))
+    return nullptr;
+  return sum;
+}
+
+bool NisseAnalysis::identifyTripCount(Loop *L, ScalarEvolution &SE,
+                                      multiset<Edge> &edges, Edge &backEdge) {
+  if (!L->getLoopPreheader() || !L->hasDedicatedExits())
+    return false;
+  const SCEV *count = SE.getBackedgeTakenCount(L);
+  if (isa<SCEVCouldNotCompute>(count) || !count->getType()->isIntegerTy() ||
+      count->getType()->getIntegerBitWidth() > 64 ||
+      !isSafeToExpandAt(count, L->getLoopPreheader()->getTerminator(), SE))
+    return false;
+
+  // The counts of a loop nest add up in closed form as long as each loop runs
+  // once per iteration of its parent, so that the whole nest is counted at
+  // the level of its outermost such loop.
+  Loop *level = L;
+  while (const SCEV *sum = sumOverParentLoop(level, count, SE)) {
+    level = level->getParentLoop();
+    count = sum;
+    NestedTripCounts++;
+  }
+
+  // The count can be added before the loop runs if nothing in the loop may
+  // leave it otherwise, such as a call to exit or an exception.
+  bool atPreheader = all_of(level->blocks(), [](BasicBlock *BB) {
+    return all_of(*BB, [](Instruction &I) {
+      return isGuaranteedToTransferExecutionToSuccessor(&I);
+    });
+  });
+  SmallVector<BlockPtr> exitBlocks;
+  level->getUniqueExitBlocks(exitBlocks);
+
+  for (auto it = edges.begin(); it != edges.end(); ++it) {
+    if (*it == backEdge) {
+      Edge newEdge = *it;
+      edges.erase(it);
+      newEdge.setTripCount(count, level->getLoopPreheader(), exitBlocks,
+                           atPreheader);
+      edges.insert(newEdge);
+      return true;
+    }
+  }
+  return false;
+}
+
+/// \brief Checks that a block of a loop runs in every iteration of the loop,
+/// before the iteration ends, by going back to the header or leaving the loop.
+/// A loop that only exits from its header, as loops that are not rotated do,
+/// runs its last iteration up to the header only.
+/// \param L The loop.
+/// \param B The block, which is not in a subloop of L.
+/// \return true if every path from the header to a latch or an exiting block
+/// goes through B, the header aside when it is the only exiting block.
+static bool runsInEveryIteration(Loop *L, BlockPtr B) {
+  bool exitsAtHeader = L->getExitingBlock() == L->getHeader();
+  set<BlockPtr> visited;
+  queue<BlockPtr> queue;
+  queue.push(L->getHeader());
+  while (!queue.empty()) {
+    auto block = queue.front();
+    queue.pop();
+    if (block == B || !visited.insert(block).second)
+      continue;
+    if (L->isLoopLatch(block) ||
+        (L->isLoopExiting(block) &&
+         !(exitsAtHeader && block == L->getHeader())))
+      return false;
+    for (auto succ : successors(block))
+      if (succ != L->getHeader() && L->contains(succ))
+        queue.push(succ);
+  }
+  return true;
+}
+
+void NisseAnalysis::identifyInvariantBranches(
+    Loop *L, ScalarEvolution &SE, multiset<Edge> &edges,
+    SmallVector<BlockPtr> &exitBlocks) {
+  // The number of iterations is read from an induction variable at the
+  // exits, whose step is a constant or a stride.
+  PHINode *indVar = nullptr;
+  const SCEV *step = nullptr;
+  BlockPtr preheader = L->getLoopPreheader();
+  for (auto &PHI : L->getHeader()->phis()) {
+    if (!preheader || !SE.isSCEVable(PHI.getType()))
+      continue;
+    auto *AddRec = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(&PHI));
+    if (AddRec && AddRec->isAffine() && AddRec->getLoop() == L &&
+        isUsableStep(SE, L, AddRec->getStepRecurrence(SE))) {
+      indVar = &PHI;
+      step = AddRec->getStepRecurrence(SE);
+      break;
+    }
+  }
+  if (!indVar)
+    return;
+  Value *initValue = indVar->getIncomingValueForBlock(preheader);
+  // The branch runs once less than the header when the loop exits there.
+  bool exitsAtHeader = L->getExitingBlock() == L->getHeader();
+
+  for (auto B : L->blocks()) {
+    auto *BR = dyn_cast<BranchInst>(B->getTerminator());
+    if (!BR || !BR->isConditional() || isa<Constant>(BR->getCondition()) ||
+        !L->isLoopInvariant(BR->getCondition()))
+      continue;
+    BlockPtr T = BR->getSuccessor(0), F = BR->getSuccessor(1);
+    if (T == F || !L->contains(T) || !L->contains(F) ||
+        T == L->getHeader() || F == L->getHeader())
+      continue;
+    if (any_of(L->getSubLoops(), [B](Loop *S) { return S->contains(B); }) ||
+        !runsInEveryIteration(L, B))
+      continue;
+    for (auto it = edges.begin(); it != edges.end();) {
+      if (it->getOrigin() == B && !it->isSESE()) {
+        Edge newEdge = *it;
+        it = edges.erase(it);
+        if (auto *constant = dyn_cast<SCEVConstant>(step))
+          newEdge.setSESE(indVar, initValue, &constant->getAPInt(),
+                          exitBlocks);
+        else
+          newEdge.setStridedSESE(indVar, initValue, step, preheader,
+                                 exitBlocks);
+        newEdge.setInvariantBranch(BR->getCondition(), newEdge.getDest() == T,
+                                   exitsAtHeader);
+        edges.insert(newEdge);
+        InvariantBranchCounters++;
+        // The iterator may see the new edge again, which is SESE now.
+      } else {
+        ++it;
+      }
+    }
+  }
+}
+
 void NisseAnalysis::identifyWellFoundedEdges(Loop *L, ScalarEvolution &SE,
                                              multiset<Edge> &edges) {
   BlockPtr incomingBlock, backBlock;
   L->getIncomingAndBackEdge(incomingBlock, backBlock);
   SmallVector<BlockPtr> exitBlocks;
-  L->getExitBlocks(exitBlocks);
+  L->getUniqueExitBlocks(exitBlocks);
   auto firstBlock = incomingBlock->getSingleSuccessor();
   if (firstBlock == nullptr) return;
   Edge backEdge(backBlock, firstBlock, -1);
+
+  // A computable trip count leaves nothing to do in the loop, and only adds a
+  // precomputed value, so it is preferred to the induction variables.
+  bool tripCount = identifyTripCount(L, SE, edges, backEdge);
+  if (tripCount)
+    TripCountCounters++;
   for (auto &PHI : firstBlock->phis()) {
-    if (identifyInductionVariable(SE, edges, &PHI, incomingBlock, backBlock,
+    // The induction variables of a loop counted with its trip count are not
+    // branch variables: they step on the back edge, which is counted already.
+    if (tripCount && SE.isSCEVable(PHI.getType()) &&
+        isa<SCEVAddRecExpr>(SE.getSCEV(&PHI)))
+      continue;
+    if (!tripCount &&
+        identifyInductionVariable(SE, edges, &PHI, incomingBlock, backBlock,
                                   backEdge, exitBlocks)) {
       SESECounters++;
       continue;
     }
-    if (identifyBranchVariable(SE, edges, &PHI, incomingBlock, backBlock,
+    // A branch variable read at the exits of an innermost loop is a reduction
+    // used outside of it, which the loop vectorizer rejects.
+    if (AnalysisUtil::isVectorizerFriendly() && L->isInnermost())
+      continue;
+    if (identifyBranchVariable(L, SE, edges, &PHI, incomingBlock, backBlock,
                                exitBlocks)) {
       SESECounters++;
       continue;
     }
   }
+  identifyInvariantBranches(L, SE, edges, exitBlocks);
+}
+
+void AnalysisUtil::identifyPromotionLoops(multiset<Edge> &edges,
+                                          LoopInfo &LI) {
+  multiset<Edge> annotated;
+  for (auto e : edges) {
+    e.setPromotionLoop(LI);
+    annotated.insert(e);
+  }
+  edges = annotated;
 }
 
 void AnalysisUtil::printGraph(Function &F, multiset<Edge> &edges,
-                              pair<multiset<Edge>, multiset<Edge>> &STrev) {
+                              pair<multiset<Edge>, multiset<Edge>> &STrev,
+                              GraphMap *graphs) {
 
   string fileName = F.getName().str() + ".graph";
 
-  errs() << "Writing '" << fileName << "'...\n";
-
   int blockCount = distance(F.begin(), F.end());
 
-  ofstream file;
-  file.open(fileName, ios::out | ios::trunc);
+  ostringstream file;
 
   file << blockCount;
   for (auto &BB : F) {
@@ -328,24 +909,32 @@ void AnalysisUtil::printGraph(Function &F, multiset<Edge> &edges,
     file << ' ' << e.getIndex();
   }
 
-  file.close();
+  if (graphs) {
+    (*graphs)[F.getName().str()] = file.str();
+    return;
+  }
+
+  errs() << "Writing '" << fileName << "'...\n";
+  ofstream(fileName, ios::out | ios::trunc) << file.str();
 }
 
 NisseAnalysis::Result NisseAnalysis::run(Function &F,
                                          FunctionAnalysisManager &FAM) {
 
-  auto edges = AnalysisUtil::generateEdges(F);
+  auto edges = AnalysisUtil::generateEdges(F, FAM);
 
   initFunctionInfo(F, FAM);
-  auto loops = LI.getLoopsInPreorder();
+  // The loops given to ScalarEvolution must be those of its own LoopInfo.
+  auto loops = FAM.getResult<LoopAnalysis>(F).getLoopsInPreorder();
   Loops += loops.size();
   for (auto loop : loops) {
     identifyWellFoundedEdges(loop, *SE, edges);
   }
+  AnalysisUtil::identifyPromotionLoops(edges, LI);
 
   auto STrev = AnalysisUtil::generateSTrev(F, edges);
 
-  AnalysisUtil::printGraph(F, edges, STrev);
+  AnalysisUtil::printGraph(F, edges, STrev, Graphs);
 
   return make_tuple(edges, STrev.first, STrev.second);
 }
@@ -353,11 +942,13 @@ NisseAnalysis::Result NisseAnalysis::run(Function &F,
 KSAnalysis::Result KSAnalysis::run(Function &F,
                                        FunctionAnalysisManager &FAM) {
 
-  auto edges = AnalysisUtil::generateEdges(F);
+  auto edges = AnalysisUtil::generateEdges(F, FAM);
+  AnalysisUtil::identifyPromotionLoops(edges,
+                                       FAM.getResult<LoopAnalysis>(F));
 
   auto STrev = AnalysisUtil::generateSTrev(F, edges);
 
-  AnalysisUtil::printGraph(F, edges, STrev);
+  AnalysisUtil::printGraph(F, edges, STrev, Graphs);
 
   return make_tuple(edges, STrev.first, STrev.second);
 }
@@ -0,0 +1,134 @@
+//===-- NisseJIT.cpp ---------------------------------------------------===//
+// Copyright (C) 2023 Leon Frenot
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// This file contains the implementation of the JITProfile
+///
+//===----------------------------------------------------------------------===//
+
+#include "NisseJIT.h"
+#include "NisseProfile.h"
+#include "NissePropagation.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include <atomic>
+#include <cstring>
+#include <sstream>
+
+using namespace llvm;
+using namespace std;
+
+namespace nisse {
+
+unique_ptr<JITProfile> JITProfile::instrument(Module &M,
+                                              JITInstrumentation Kind,
+                                              CounterMode Mode) {
+  static atomic<unsigned> NextModule{0};
+  unique_ptr<JITProfile> Profile(new JITProfile());
+  Profile->Symbol = "__nisse_module_" + to_string(NextModule++);
+
+  // The passes name the vertices of the graphs after the blocks.
+  for (Function &F : M) {
+    int n = 0;
+    for (BasicBlock &BB : F)
+      BB.setName("");
+    for (BasicBlock &BB : F)
+      BB.setName("bb" + to_string(n++));
+  }
+
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  GraphMap *Graphs = &Profile->Graphs;
+  FAM.registerPass([Graphs] { return NisseAnalysis(Graphs); });
+  FAM.registerPass([Graphs] { return KSAnalysis(Graphs); });
+
+  PassBuilder PB;
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  FunctionPassManager FPM;
+  FPM.addPass(LoopSimplifyPass());
+  ModulePassManager MPM;
+  MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+  if (Kind == JITInstrumentation::KS)
+    MPM.addPass(KSPass(Profile->Symbol, Mode));
+  else
+    MPM.addPass(NissePass(Profile->Symbol, Mode));
+  MPM.run(M, MAM);
+
+  return Profile;
+}
+
+Error JITProfile::attach(orc::LLJIT &J, orc::JITDylib &JD) {
+  auto Sym = J.lookup(JD, Symbol);
+  if (!Sym)
+    return Sym.takeError();
+  Descriptor = jitTargetAddressToPointer<const nisse_module *>(Sym->getAddress());
+  return Error::success();
+}
+
+map<string, FunctionFrequencies> JITProfile::getFrequencies() const {
+  map<string, FunctionFrequencies> frequencies;
+  if (!Descriptor)
+    return frequencies;
+
+  const nisse_module *module = Descriptor;
+  for (int f = 0; f < module->num_functions; f++) {
+    const nisse_function &function = module->functions[f];
+
+    // The counters may be updated by running code: each one is read whole.
+    vpi prof;
+    for (int i = function.offset; i < function.offset + function.size; i++) {
+      long long count;
+      if (module->flags & NISSE_MODULE_COMPACT) {
+        uint32_t low = __atomic_load_n((uint32_t *)module->counters + i,
+                                       __ATOMIC_RELAXED);
+        long long high = __atomic_load_n(module->spill + i, __ATOMIC_RELAXED);
+        count = (long long)(((unsigned long long)high << 32) + low);
+      } else {
+        count = __atomic_load_n(module->counters + i, __ATOMIC_RELAXED);
+      }
+      prof.emplace_back(module->indices[i], count);
+    }
+
+    auto graph = Graphs.find(function.name);
+    if (graph == Graphs.end())
+      continue;
+    istringstream stream(graph->second);
+    auto &result = frequencies[function.name];
+    result.edgeCounts = propagateGraph(stream, prof, result.edges);
+    for (size_t e = 0; e < result.edges.size(); e++)
+      result.blockCounts[result.edges[e].second] += result.edgeCounts[e];
+  }
+  return frequencies;
+}
+
+void JITProfile::reset() {
+  if (!Descriptor)
+    return;
+  size_t width = Descriptor->flags & NISSE_MODULE_COMPACT ? 4 : 8;
+  memset(Descriptor->counters, 0, width * Descriptor->capacity);
+  if (Descriptor->spill)
+    memset(Descriptor->spill, 0, 8ull * Descriptor->size);
+}
+
+} // namespace nisse
@@ -21,14 +21,91 @@
 //===----------------------------------------------------------------------===//
 
 #include "Nisse.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Path.h"
+#include "NisseProfile.h"
+#include "NisseProfileReader.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
 #include <iostream>
 
+#define DEBUG_TYPE "nisse"
+
 static llvm::cl::opt<bool>
     DisableProfilePrinting("nisse-disable-print", llvm::cl::init(false),
                            llvm::cl::desc("Disable Profile Printing"));
 
+static llvm::cl::opt<std::string> InfoFile(
+    "nisse-info-file", llvm::cl::init("info.prof"),
+    llvm::cl::desc("The file listing the instrumented functions, where %m "
+                   "stands for the name of the module's source file"),
+    llvm::cl::value_desc("filename"));
+
+static llvm::cl::opt<nisse::CounterMode> CounterUpdateMode(
+    "nisse-counter-mode", llvm::cl::init(nisse::CounterMode::Plain),
+    llvm::cl::desc("How the instrumentation updates the counters"),
+    llvm::cl::values(
+        clEnumValN(nisse::CounterMode::Plain, "plain",
+                   "Load, add and store on a global array (default)"),
+        clEnumValN(nisse::CounterMode::Atomic, "atomic",
+                   "Relaxed atomic add on a global array"),
+        clEnumValN(nisse::CounterMode::Sharded, "sharded",
+                   "Thread-local shards, merged when threads exit")));
+
+static llvm::cl::opt<bool> ContinuousMode(
+    "nisse-continuous", llvm::cl::init(false),
+    llvm::cl::desc("Map the counters onto the profile file when the program "
+                   "starts, instead of writing them when the program exits"));
+
+static llvm::cl::opt<unsigned> ContinuousPageSize(
+    "nisse-continuous-page-size", llvm::cl::init(65536),
+    llvm::cl::desc("The page size that the counter-array is aligned and "
+                   "padded to in continuous mode, at least the one of the "
+                   "target (64K by default, the largest one of supported "
+                   "targets)"),
+    llvm::cl::value_desc("bytes"));
+
+static llvm::cl::opt<bool> CompactCounters(
+    "nisse-compact-counters", llvm::cl::init(false),
+    llvm::cl::desc("Use 32-bit counters, whose overflows are spilled to a "
+                   "side array of 64-bit counters"));
+
+static llvm::cl::opt<nisse::CounterLayout> CounterLayoutKind(
+    "nisse-counter-layout", llvm::cl::init(nisse::CounterLayout::Module),
+    llvm::cl::desc("How the counters are placed in the counter-array"),
+    llvm::cl::values(
+        clEnumValN(nisse::CounterLayout::Module, "module",
+                   "In the order of the functions in the module (default)"),
+        clEnumValN(nisse::CounterLayout::Loops, "loops",
+                   "Hot functions first, by the loop depth of their counters"),
+        clEnumValN(nisse::CounterLayout::Profile, "profile",
+                   "Hot functions first, by their counts in a previous "
+                   "profile given with -nisse-layout-profile")));
+
+static llvm::cl::opt<std::string> LayoutProfile(
+    "nisse-layout-profile", llvm::cl::init("main.prof"),
+    llvm::cl::desc("The binary profile used by -nisse-counter-layout=profile"),
+    llvm::cl::value_desc("filename"));
+
+static llvm::cl::opt<bool> Sampling(
+    "nisse-sampling", llvm::cl::init(false),
+    llvm::cl::desc("Give each function a fast copy without counters, and only "
+                   "run the copy with counters on sampled calls"));
+
+static llvm::cl::opt<bool> PromoteCounters(
+    "nisse-promote-counters", llvm::cl::init(false),
+    llvm::cl::desc("Keep the counters of edges inside loops in registers, "
+                   "and add them to the counter-array at the loops' exits"));
+
 using namespace llvm;
 using namespace std;
 
@@ -60,200 +137,658 @@ NissePass::insertEntryFn(Function &F, multiset<Edge> &reverseSTEdges) {
   return pair(counterInst, indexInst);
 }
 
-void NissePass::insertExitFn(llvm::Module &M, llvm::Function &F, llvm::Value *counterInst,
-                             llvm::Value *indexInst, int size) {
-  LLVMContext &Ctx = M.getContext();
-
-  Type *r_type = Type::getVoidTy(Ctx);
-
-  SmallVector<Type *, 3> a_types;
-  SmallVector<Value *, 3> a_vals;
-
-
-  a_types.push_back(CounterArray->getType());
-  a_vals.push_back(CounterArray);
-
-  a_types.push_back(IndexArray->getType());
-  a_vals.push_back(IndexArray);
+StructType *NissePass::getFunctionDescriptorType(LLVMContext &Ctx) {
+  if (auto Ty = StructType::getTypeByName(Ctx, "nisse.function"))
+    return Ty;
+  return StructType::create(
+      Ctx,
+      {PointerType::getUnqual(Type::getInt8Ty(Ctx)), Type::getInt64Ty(Ctx),
+       Type::getInt32Ty(Ctx), Type::getInt32Ty(Ctx)},
+      "nisse.function");
+}
 
-  a_types.push_back(Type::getInt32Ty(Ctx));
-  a_vals.push_back(ConstantInt::get(Type::getInt32Ty(Ctx), size));
+Constant *NissePass::createFunctionDescriptor(Module &M, Function &F,
+                                              int offset, int size) {
+  LLVMContext &Ctx = M.getContext();
+  auto name = ConstantDataArray::getString(Ctx, F.getName());
+  auto nameVar = new GlobalVariable(M, name->getType(), true,
+                                    GlobalValue::PrivateLinkage, name,
+                                    "nisse.name." + F.getName());
+  nameVar->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+
+  return ConstantStruct::get(
+      getFunctionDescriptorType(Ctx),
+      {ConstantExpr::getPointerBitCastOrAddrSpaceCast(
+           nameVar, PointerType::getUnqual(Type::getInt8Ty(Ctx))),
+       ConstantInt::get(Type::getInt64Ty(Ctx), MD5Hash(F.getName())),
+       ConstantInt::get(Type::getInt32Ty(Ctx), offset),
+       ConstantInt::get(Type::getInt32Ty(Ctx), size)});
+}
 
-  FunctionType *f_type = FunctionType::get(r_type, a_types, false);
-  FunctionCallee f_call = M.getOrInsertFunction("nisse_pass_print_data", f_type);
+void NissePass::insertModuleRegistration(Module &M, int capacity, int flags) {
+  LLVMContext &Ctx = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+
+  // The layout of struct nisse_module in NisseProfile.h. In sharded mode, the
+  // counter-array is thread local, and the runtime is given the total array.
+  PointerType *PtrTy = PointerType::getUnqual(Type::getInt64Ty(Ctx));
+  PointerType *NameTy = PointerType::getUnqual(Type::getInt8Ty(Ctx));
+  GlobalVariable *Counted = TotalArray ? TotalArray : CounterArray;
+  StructType *ModuleType = StructType::create(
+      Ctx,
+      {Counted->getType(), IndexArray->getType(), FunctionTable->getType(),
+       Int32Ty, Int32Ty, Int32Ty, Int32Ty, PtrTy, NameTy},
+      "nisse.module");
+  auto *TableType = cast<ArrayType>(FunctionTable->getValueType());
+  Constant *Spill = ConstantPointerNull::get(PtrTy);
+  if (SpillArray)
+    Spill = ConstantExpr::getPointerBitCastOrAddrSpaceCast(SpillArray, PtrTy);
+  auto name = ConstantDataArray::getString(Ctx, M.getSourceFileName());
+  auto nameVar = new GlobalVariable(M, name->getType(), true,
+                                    GlobalValue::PrivateLinkage, name,
+                                    "nisse.module_name");
+  auto descriptor = ConstantStruct::get(
+      ModuleType,
+      {Counted, IndexArray, FunctionTable, ConstantInt::get(Int32Ty, NumSlots),
+       ConstantInt::get(Int32Ty, capacity),
+       ConstantInt::get(Int32Ty, TableType->getNumElements()),
+       ConstantInt::get(Int32Ty, flags), Spill,
+       ConstantExpr::getPointerBitCastOrAddrSpaceCast(nameVar, NameTy)});
+  auto ModuleDescriptor = new GlobalVariable(
+    M, ModuleType, true, GlobalValue::PrivateLinkage, descriptor, "nisse-module"
+  );
 
-  for (BasicBlock &BB : F) {
-    Instruction *Terminator = BB.getTerminator();
-    if (isa<ReturnInst>(Terminator)) {
-      IRBuilder<> builder(Terminator);
-      builder.CreateCall(f_call, a_vals);
-    }
+  // For the in-process API, the descriptor is looked up by name instead.
+  if (!ModuleSymbol.empty()) {
+    ModuleDescriptor->setLinkage(GlobalValue::ExternalLinkage);
+    ModuleDescriptor->setName(ModuleSymbol);
+    return;
   }
+
+  // The destructor runs when the program exits, or when the shared object
+  // holding the module is unloaded.
+  FunctionType *f_type = FunctionType::get(
+      Type::getVoidTy(Ctx), {ModuleDescriptor->getType()}, false);
+  auto createCall = [&](StringRef runtime, StringRef name) {
+    FunctionCallee f_call = M.getOrInsertFunction(runtime, f_type);
+    Function *Fn =
+        Function::Create(FunctionType::get(Type::getVoidTy(Ctx), false),
+                         GlobalValue::InternalLinkage, name, M);
+    IRBuilder<> builder(BasicBlock::Create(Ctx, "", Fn));
+    builder.CreateCall(f_call, {ModuleDescriptor});
+    builder.CreateRetVoid();
+    return Fn;
+  };
+  appendToGlobalCtors(
+      M, createCall("nisse_pass_register_module", "nisse.module_ctor"), 0);
+  appendToGlobalDtors(
+      M, createCall("nisse_pass_unregister_module", "nisse.module_dtor"), 0);
 }
 
-PreservedAnalyses NissePass::run(Module &M, ModuleAnalysisManager &MAM) {
+void NissePass::insertSamplingDispatch(Module &M, Function &F, LoopInfo &LI) {
   LLVMContext &Ctx = M.getContext();
-  FunctionAnalysisManager &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
-
-  outfile.open("info.prof");
-  // Associate function to its number of edges
-  for (Function &F : M) {
-    if (F.isDeclaration()) continue;
-    auto &edges = FAM.getResult<NisseAnalysis>(F);
-    auto &reverseSTEdges = get<2>(edges);
-    int size = reverseSTEdges.size();
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  auto getRuntimeGlobal = [&](StringRef name) {
+    if (auto G = M.getNamedGlobal(name))
+      return G;
+    return new GlobalVariable(M, Int32Ty, false, GlobalValue::ExternalLinkage,
+                              nullptr, name);
+  };
+  GlobalVariable *Countdown = getRuntimeGlobal("nisse_sample_countdown");
+  GlobalVariable *Period = getRuntimeGlobal("nisse_sample_period");
+
+  // The static allocas move to a new entry block, so that both copies share
+  // them.
+  BasicBlock *Entry = &F.getEntryBlock();
+  BasicBlock *Dispatch = BasicBlock::Create(Ctx, "nisse.dispatch", &F, Entry);
+  IRBuilder<> builder(Dispatch);
+  for (auto &I : make_early_inc_range(*Entry)) {
+    if (auto AI = dyn_cast<AllocaInst>(&I))
+      if (AI->isStaticAlloca())
+        AI->moveBefore(*Dispatch, Dispatch->end());
+  }
 
-    if (size == 1) {
-      errs() << "Function '" << F.getName()
-            << "' has only 1 edge to instrument. Skipping...\n";
+  SmallVector<BasicBlock *> blocks;
+  for (auto &BB : F)
+    if (&BB != Dispatch)
+      blocks.push_back(&BB);
+
+  ValueToValueMapTy VMap;
+  SmallVector<BasicBlock *> clones;
+  for (auto BB : blocks) {
+    auto clone = CloneBasicBlock(BB, VMap, ".fast", &F);
+    VMap[BB] = clone;
+    clones.push_back(clone);
+  }
+  remapInstructionsInBlocks(clones, VMap);
+
+  // Counts down on every call, and switches to the copy with counters once the
+  // countdown is over. The period is then reloaded: if it is zero, sampling is
+  // disabled, and the countdown is set as far away as possible.
+  auto count = builder.CreateSub(builder.CreateLoad(Int32Ty, Countdown),
+                                 builder.getInt32(1));
+  builder.CreateStore(count, Countdown);
+  auto over = builder.CreateICmpSLE(count, builder.getInt32(0));
+  auto weights = MDBuilder(Ctx).createBranchWeights(1, 1 << 20);
+  BasicBlock *Sample = BasicBlock::Create(Ctx, "nisse.sample", &F, Entry);
+  auto Fast = cast<BasicBlock>(VMap[Entry]);
+  builder.CreateCondBr(over, Sample, Fast, weights);
+
+  builder.SetInsertPoint(Sample);
+  auto period = builder.CreateLoad(Int32Ty, Period);
+  auto enabled = builder.CreateICmpNE(period, builder.getInt32(0));
+  builder.CreateStore(
+      builder.CreateSelect(enabled, period, builder.getInt32(INT32_MAX)),
+      Countdown);
+  builder.CreateCondBr(enabled, Entry, Fast);
+
+  // The back edges of the fast copy count down as well, so that functions
+  // running long loops are sampled more often, except those of innermost loops
+  // in vectorizer-friendly mode.
+  for (auto L : LI.getLoopsInPreorder()) {
+    if (AnalysisUtil::isVectorizerFriendly() && L->isInnermost())
       continue;
+    SmallVector<BasicBlock *> latches;
+    L->getLoopLatches(latches);
+    for (auto latch : latches) {
+      builder.SetInsertPoint(cast<BasicBlock>(VMap[latch])->getTerminator());
+      auto value = builder.CreateLoad(Int32Ty, Countdown);
+      builder.CreateStore(builder.CreateSub(value, builder.getInt32(1)),
+                          Countdown);
     }
-
-    NumEdges += size;
-    FunctionSize[F.getName().str()] = size;
-    outfile << F.getName().str() << " " << size << "\n";
   }
-  outfile.close();
+}
 
-  // Initialize global variables
-  ArrayType *CounterArrayType = ArrayType::get(Type::getInt64Ty(Ctx), NumEdges);
-  CounterArray = new GlobalVariable(
-    M, CounterArrayType, false, GlobalValue::ExternalLinkage,
-    Constant::getNullValue(CounterArrayType), "counter-array"
-  );
+void NissePass::insertShardRegistration(Module &M, Function &F) {
+  LLVMContext &Ctx = M.getContext();
+  BasicBlock &Entry = F.getEntryBlock();
 
-  ArrayType *IndexArrayType = ArrayType::get(Type::getInt32Ty(Ctx), NumEdges);
-  IndexArray = new GlobalVariable(
-    M, IndexArrayType, false, GlobalValue::ExternalLinkage,
-    Constant::getNullValue(IndexArrayType), "index-array"
-  );
+  // Split after the last alloca, so that static allocas stay in the entry.
+  Instruction *splitPoint = &*Entry.getFirstInsertionPt();
+  for (auto &I : Entry) {
+    if (isa<AllocaInst>(I))
+      splitPoint = I.getNextNode();
+  }
 
-  for (Function &F : M) {
-    if (F.isDeclaration()) continue;
-    auto &edges = FAM.getResult<NisseAnalysis>(F);
-    auto &reverseSTEdges = get<2>(edges);
-    int size = reverseSTEdges.size();
+  IRBuilder<> builder(splitPoint);
+  auto *Int8Ty = builder.getInt8Ty();
+  auto flag = builder.CreateLoad(Int8Ty, ShardFlag);
+  auto cond = builder.CreateICmpEQ(flag, builder.getInt8(0));
+  auto weights = MDBuilder(Ctx).createBranchWeights(1, 1 << 20);
+  auto then = SplitBlockAndInsertIfThen(cond, splitPoint, false, weights);
+
+  FunctionType *f_type = FunctionType::get(
+      Type::getVoidTy(Ctx),
+      {CounterArray->getType(), TotalArray->getType(), builder.getInt32Ty()},
+      false);
+  FunctionCallee f_call =
+      M.getOrInsertFunction("nisse_pass_register_shard", f_type);
+
+  builder.SetInsertPoint(then);
+  builder.CreateCall(f_call, {CounterArray, TotalArray,
+                              builder.getInt32(NumSlots)});
+  builder.CreateStore(builder.getInt8(1), ShardFlag);
+}
 
-    // if (F.getName() == "main") {
-    //   IRBuilder<> mainBuilder(&F.getEntryBlock(), F.getEntryBlock().begin());
-    //   auto cast = mainBuilder.CreateGEP(mainBuilder.getInt64Ty(), CounterArray, {mainBuilder.getInt64(0)});
-    //   auto zero = mainBuilder.getInt64(0);
-    //   mainBuilder.CreateMemSet(cast, zero, NumEdges * sizeof(int64_t), CounterArray->getAlign());
-    // }
+void NissePass::insertDispatchIncr(Module &M, BasicBlock *BB,
+                                   const std::vector<int> &slots,
+                                   const Counters &counters) {
+  auto SI = cast<SwitchInst>(BB->getTerminator());
+  APInt low = SI->case_begin()->getCaseValue()->getValue();
+  for (auto Case : SI->cases())
+    if (Case.getCaseValue()->getValue().slt(low))
+      low = Case.getCaseValue()->getValue();
+
+  // The table gives the slot of the edge taken for each value in the range of
+  // the cases. Successor 0 is the default destination, and successor k + 1
+  // the destination of case k.
+  std::vector<uint32_t> table;
+  for (auto Case : SI->cases()) {
+    uint64_t at = (Case.getCaseValue()->getValue() - low).getZExtValue();
+    if (at >= table.size())
+      table.resize(at + 1, slots[0]);
+    table[at] = slots[Case.getSuccessorIndex()];
+  }
+  auto init = ConstantDataArray::get(M.getContext(), table);
+  auto tableVar = new GlobalVariable(M, init->getType(), true,
+                                     GlobalValue::PrivateLinkage, init,
+                                     "nisse.dispatch." + BB->getName());
+  tableVar->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+
+  IRBuilder<> builder(SI);
+  auto *L = builder.getInt64Ty();
+  auto offset = builder.CreateSub(SI->getCondition(),
+                                  ConstantInt::get(M.getContext(), low));
+  // The last offset, rather than the size of the table, which wraps to 0 when
+  // the cases cover the whole range of the condition.
+  auto inRange = builder.CreateICmpULE(
+      offset, ConstantInt::get(offset->getType(), table.size() - 1));
+  auto index = builder.CreateSelect(
+      inRange, builder.CreateZExtOrTrunc(offset, L), builder.getInt64(0));
+  Value *indexList[] = {builder.getInt64(0), index};
+  auto entry = builder.CreateLoad(
+      builder.getInt32Ty(),
+      builder.CreateInBoundsGEP(init->getType(), tableVar, indexList));
+  auto slot = builder.CreateSelect(inRange, entry, builder.getInt32(slots[0]));
+  counters.createIncr(builder, builder.CreateZExt(slot, L),
+                      builder.getInt64(1));
+}
 
-    if (size == 1) {
-      if (!DisableProfilePrinting)
-        if (F.getName() == "main")
-          this->insertExitFn(M, F, CounterArray, IndexArray, NumEdges);
+void NissePass::reportInnermostLoopCounters(Module &M, Function &F) {
+  SmallPtrSet<Value *, 4> counted = {CounterArray, SpillArray,
+                                     M.getNamedGlobal("nisse_sample_countdown")};
+  DominatorTree DT(F);
+  LoopInfo LI(DT);
+  OptimizationRemarkEmitter ORE(&F);
+  for (Loop *L : LI.getLoopsInPreorder()) {
+    if (!L->isInnermost())
       continue;
+    int updates = 0;
+    for (BasicBlock *BB : L->blocks()) {
+      for (Instruction &I : *BB) {
+        Value *pointer = nullptr;
+        if (auto SI = dyn_cast<StoreInst>(&I))
+          pointer = SI->getPointerOperand();
+        else if (auto RMW = dyn_cast<AtomicRMWInst>(&I))
+          pointer = RMW->getPointerOperand();
+        if (pointer && counted.count(getUnderlyingObject(pointer)))
+          updates++;
+      }
     }
+    if (!updates)
+      continue;
+    ORE.emit([&]() {
+      return OptimizationRemarkMissed(DEBUG_TYPE, "CounterInInnermostLoop",
+                                      L->getStartLoc(), L->getHeader())
+             << "innermost loop still updates " << ore::NV("Updates", updates)
+             << " counter(s) in memory, which may keep it from being "
+                "vectorized";
+    });
+  }
+}
 
-    // Equivalent to InsertEntryFn for IndexArray
-    IRBuilder<> builder(&F.getEntryBlock(), F.getEntryBlock().begin());
+map<int, Value *> NissePass::expandTripCounts(Function &F,
+                                              const multiset<Edge> &edges,
+                                              FunctionAnalysisManager &FAM) {
+  map<int, Value *> tripCounts;
+  for (auto &e : edges) {
+    if (!e.hasTripCount())
+      continue;
+    auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+    SCEVExpander expander(SE, F.getParent()->getDataLayout(), "nisse.trip");
+    Type *I64 = Type::getInt64Ty(F.getContext());
+    tripCounts[e.getIndex()] = expander.expandCodeFor(
+        SE.getNoopOrZeroExtend(e.getTripCount(), I64), I64,
+        e.getTripCountPreheader()->getTerminator());
+  }
+  return tripCounts;
+}
 
-    Type *Int32Ty = builder.getInt32Ty();
+map<int, Value *> NissePass::expandStrides(Function &F,
+                                           const multiset<Edge> &edges,
+                                           FunctionAnalysisManager &FAM) {
+  map<int, Value *> strides;
+  for (auto &e : edges) {
+    if (!e.hasStride() || e.hasTripCount())
+      continue;
+    auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+    SCEVExpander expander(SE, F.getParent()->getDataLayout(), "nisse.stride");
+    Type *I64 = Type::getInt64Ty(F.getContext());
+    strides[e.getIndex()] = expander.expandCodeFor(
+        SE.getNoopOrSignExtend(e.getStride(), I64), I64,
+        e.getStridePreheader()->getTerminator());
+  }
+  return strides;
+}
 
-    int index = Offset;
-    for (auto e : reverseSTEdges) {
-      auto indexCst = builder.getInt32(e.getIndex());
-      Value *indexList[] = {builder.getInt32(index++)};
+template <typename AnalysisT>
+void NissePass::layoutCounters(Module &M, FunctionAnalysisManager &FAM,
+                               int lineSlots) {
+  CounterLayout layout = CounterLayoutKind;
+  map<string, EdgeCounts> previous;
+  if (layout == CounterLayout::Profile &&
+      (!isBinaryProfile(LayoutProfile) ||
+       !readBinaryProfile(LayoutProfile, previous))) {
+    errs() << "Could not read the binary profile '" << LayoutProfile
+           << "'. Laying out the counters in module order...\n";
+    layout = CounterLayout::Module;
+  }
 
-      auto cast = builder.CreateGEP(Int32Ty, IndexArray, indexList);
-      builder.CreateStore(indexCst, cast);
-    }
+  // The heat of each counter, and of each function, which is the heat of its
+  // hottest counter with the loops layout, and its total count with the
+  // profile layout. Functions with no heat are cold.
+  struct Group {
+    Function *F;
+    long long heat;
+    std::vector<int> order; ///< The positions of the edges, hottest first.
+  };
+  std::vector<Group> hot, cold;
 
-    index = Offset;
-    for (auto p : reverseSTEdges) {
-      p.insertIncrFn(index++, CounterArray);
+  for (Function &F : M) {
+    if (F.isDeclaration() || !FunctionSize.count(F.getName().str()))
+      continue;
+    auto &reverseSTEdges = get<2>(FAM.getResult<AnalysisT>(F));
+    Group group = {&F, 0, {}};
+
+    // The heat of each edge and, with the loops layout, the position of the
+    // header of its innermost loop, so that the counters of a loop are next to
+    // each other.
+    std::vector<std::pair<long long, int>> keys;
+    if (layout == CounterLayout::Loops) {
+      auto &LI = FAM.getResult<LoopAnalysis>(F);
+      std::map<BasicBlock *, int> position;
+      int n = 0;
+      for (auto &BB : F)
+        position[&BB] = n++;
+      for (auto &e : reverseSTEdges) {
+        Loop *L = LI.getLoopFor(e.getUpdateBlock());
+        keys.push_back({L ? L->getLoopDepth() : 0,
+                        L ? position[L->getHeader()] : 0});
+        group.heat = max(group.heat, keys.back().first);
+      }
+    } else if (layout == CounterLayout::Profile) {
+      std::map<long long, long long> counts(
+          previous[F.getName().str()].begin(),
+          previous[F.getName().str()].end());
+      for (auto &e : reverseSTEdges) {
+        keys.push_back({counts[e.getIndex()], 0});
+        group.heat += keys.back().first;
+      }
+    } else {
+      keys.resize(reverseSTEdges.size());
     }
 
-    if (!DisableProfilePrinting)
-      if (F.getName() == "main")
-        this->insertExitFn(M, F, CounterArray, IndexArray, NumEdges);
-
-    Offset += size;
+    for (int k = 0; k < (int)keys.size(); k++)
+      group.order.push_back(k);
+    stable_sort(group.order.begin(), group.order.end(), [&](int a, int b) {
+      if (keys[a].first != keys[b].first)
+        return keys[a].first > keys[b].first;
+      return keys[a].second < keys[b].second;
+    });
+
+    if (layout != CounterLayout::Module && group.heat > 0)
+      hot.push_back(group);
+    else
+      cold.push_back(group);
   }
 
-  return PreservedAnalyses::all();
+  // Hot functions come first, each starting on its own cache line, and cold
+  // functions are packed after them.
+  stable_sort(hot.begin(), hot.end(), [](const Group &a, const Group &b) {
+    return a.heat > b.heat;
+  });
+  NumSlots = 0;
+  for (auto groups : {&hot, &cold}) {
+    for (auto &group : *groups) {
+      if (groups == &hot)
+        NumSlots = (NumSlots + lineSlots - 1) / lineSlots * lineSlots;
+      FunctionOffset[group.F] = NumSlots;
+      auto &slots = Slots[group.F];
+      slots.resize(group.order.size());
+      for (int r = 0; r < (int)group.order.size(); r++)
+        slots[group.order[r]] = NumSlots + r;
+      NumSlots += group.order.size();
+    }
+  }
 }
 
-PreservedAnalyses KSPass::run(Module &M, ModuleAnalysisManager &MAM) {
+template <typename AnalysisT>
+PreservedAnalyses NissePass::instrumentModule(Module &M,
+                                              ModuleAnalysisManager &MAM) {
   LLVMContext &Ctx = M.getContext();
   FunctionAnalysisManager &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
 
-  outfile.open("info.prof");
+  // Code instrumented for the in-process API has no runtime, and writes no
+  // file: its counters are read through its descriptor.
+  bool InProcess = !ModuleSymbol.empty();
+  CounterMode Mode = CounterUpdateMode;
+  if (InProcess)
+    Mode = JITCounterMode == CounterMode::Sharded ? CounterMode::Atomic
+                                                  : JITCounterMode;
+
+  // Each module lists its functions in its own info file, when %m is used.
+  std::string infoFile = InfoFile;
+  for (size_t at = infoFile.find("%m"); at != std::string::npos;
+       at = infoFile.find("%m", at)) {
+    std::string stem = sys::path::stem(M.getSourceFileName()).str();
+    infoFile.replace(at, 2, stem);
+    at += stem.size();
+  }
+  if (!InProcess)
+    outfile.open(infoFile);
   // Associate function to its number of edges
   for (Function &F : M) {
     if (F.isDeclaration()) continue;
-    auto &edges = FAM.getResult<KSAnalysis>(F);
+    auto &edges = FAM.getResult<AnalysisT>(F);
     auto &reverseSTEdges = get<2>(edges);
     int size = reverseSTEdges.size();
 
     if (size == 1) {
-      errs() << "Function '" << F.getName()
-            << "' has only 1 edge to instrument. Skipping...\n";
+      if (!InProcess)
+        errs() << "Function '" << F.getName()
+               << "' has only 1 edge to instrument. Skipping...\n";
       continue;
     }
 
     NumEdges += size;
     FunctionSize[F.getName().str()] = size;
-    outfile << F.getName().str() << " " << size << "\n";
+    if (!InProcess)
+      outfile << F.getName().str() << " " << size << "\n";
+  }
+  if (!InProcess)
+    outfile.close();
+
+  bool Continuous = ContinuousMode && !InProcess;
+  if (Continuous && Mode == CounterMode::Sharded) {
+    errs() << "Continuous mode does not support sharded counters. "
+              "Ignoring -nisse-continuous...\n";
+    Continuous = false;
+  }
+
+  bool Compact = CompactCounters;
+  if (Compact && (Continuous || Mode == CounterMode::Sharded)) {
+    errs() << "Compact counters are not supported in continuous or sharded "
+              "mode. Ignoring -nisse-compact-counters...\n";
+    Compact = false;
+  }
+
+  const int LineSize = 64;
+  int LineSlots = LineSize / (Compact ? sizeof(int32_t) : sizeof(int64_t));
+  this->layoutCounters<AnalysisT>(M, FAM, LineSlots);
+  // The hot groups start on multiples of LineSlots, which are only cache
+  // lines if the arrays are aligned on them.
+  MaybeAlign LineAlign;
+  if (CounterLayoutKind != CounterLayout::Module)
+    LineAlign = Align(LineSize);
+
+  // In continuous mode, the counter-array fills whole pages of its own
+  // section, so that the runtime can map them onto the profile file. Pages
+  // are 4K on x86, but 16K on Apple arm64 and up to 64K on aarch64 and
+  // ppc64 Linux, so the default fits all of them.
+  int PageSize = ContinuousPageSize;
+  if (Continuous && (PageSize < 8 || !isPowerOf2_32(PageSize))) {
+    errs() << "The page size must be a power of two. "
+              "Using -nisse-continuous-page-size=65536...\n";
+    PageSize = 65536;
+  }
+  int Capacity = NumSlots;
+  if (Continuous) {
+    int SlotsPerPage = PageSize / sizeof(int64_t);
+    Capacity = max(1, (NumSlots + SlotsPerPage - 1) / SlotsPerPage) *
+               SlotsPerPage;
   }
-  outfile.close();
 
   // Initialize global variables
-  ArrayType *CounterArrayType = ArrayType::get(Type::getInt64Ty(Ctx), NumEdges);
+  Type *CounterType = Compact ? Type::getInt32Ty(Ctx) : Type::getInt64Ty(Ctx);
+  ArrayType *CounterArrayType = ArrayType::get(CounterType, Capacity);
   CounterArray = new GlobalVariable(
-    M, CounterArrayType, false, GlobalValue::ExternalLinkage,
+    M, CounterArrayType, false, GlobalValue::InternalLinkage,
     Constant::getNullValue(CounterArrayType), "counter-array"
   );
+  CounterArray->setAlignment(LineAlign);
+  if (Continuous) {
+    bool MachO = Triple(M.getTargetTriple()).isOSBinFormatMachO();
+    CounterArray->setSection(MachO ? "__DATA,__nisse_cnts" : "nisse_cnts");
+    CounterArray->setAlignment(Align(PageSize));
+  }
 
-  ArrayType *IndexArrayType = ArrayType::get(Type::getInt32Ty(Ctx), NumEdges);
+  // The index-array is constant: its initializer is set once every edge has
+  // been given a slot.
+  ArrayType *IndexArrayType = ArrayType::get(Type::getInt32Ty(Ctx), NumSlots);
   IndexArray = new GlobalVariable(
-    M, IndexArrayType, false, GlobalValue::ExternalLinkage,
+    M, IndexArrayType, true, GlobalValue::InternalLinkage,
     Constant::getNullValue(IndexArrayType), "index-array"
   );
+  std::vector<uint32_t> indices(NumSlots, -1);
+
+  // Likewise for the table of function descriptors.
+  ArrayType *FunctionTableType = ArrayType::get(
+      getFunctionDescriptorType(Ctx), FunctionSize.size());
+  FunctionTable = new GlobalVariable(
+    M, FunctionTableType, true, GlobalValue::InternalLinkage,
+    Constant::getNullValue(FunctionTableType), "nisse-functions"
+  );
+  std::vector<Constant *> descriptors;
+
+  // In sharded mode, the counter-array is thread local, and the runtime
+  // merges each shard into the total array when its thread exits.
+  if (Mode == CounterMode::Sharded) {
+    CounterArray->setThreadLocal(true);
+
+    TotalArray = new GlobalVariable(
+      M, CounterArrayType, false, GlobalValue::InternalLinkage,
+      Constant::getNullValue(CounterArrayType), "counter-array.total"
+    );
+    TotalArray->setAlignment(LineAlign);
+
+    Type *Int8Ty = Type::getInt8Ty(Ctx);
+    ShardFlag = new GlobalVariable(
+      M, Int8Ty, false, GlobalValue::InternalLinkage,
+      Constant::getNullValue(Int8Ty), "counter-array.registered"
+    );
+    ShardFlag->setThreadLocal(true);
+  }
+
+  Counters counters = {CounterArray, Mode};
+
+  // In compact mode, the carries out of the 32-bit counters go to the spill
+  // array, which is only touched when a counter overflows.
+  if (Compact) {
+    ArrayType *SpillArrayType = ArrayType::get(Type::getInt64Ty(Ctx), NumSlots);
+    SpillArray = new GlobalVariable(
+      M, SpillArrayType, false, GlobalValue::InternalLinkage,
+      Constant::getNullValue(SpillArrayType), "counter-array.spill"
+    );
+    SpillArray->setAlignment(LineAlign);
+    counters.spill = SpillArray;
+  }
 
   for (Function &F : M) {
     if (F.isDeclaration()) continue;
-    auto &edges = FAM.getResult<KSAnalysis>(F);
+    auto &edges = FAM.getResult<AnalysisT>(F);
     auto &reverseSTEdges = get<2>(edges);
     int size = reverseSTEdges.size();
 
-    if (size == 1) {
-      if (!DisableProfilePrinting)
-        if (F.getName() == "main")
-          this->insertExitFn(M, F, CounterArray, IndexArray, NumEdges);
-      continue;
-    }
-
-    // Equivalent to InsertEntryFn for IndexArray
-    IRBuilder<> builder(&F.getEntryBlock(), F.getEntryBlock().begin());
+    // if (F.getName() == "main") {
+    //   IRBuilder<> mainBuilder(&F.getEntryBlock(), F.getEntryBlock().begin());
+    //   auto cast = mainBuilder.CreateGEP(mainBuilder.getInt64Ty(), CounterArray, {mainBuilder.getInt64(0)});
+    //   auto zero = mainBuilder.getInt64(0);
+    //   mainBuilder.CreateMemSet(cast, zero, NumEdges * sizeof(int64_t), CounterArray->getAlign());
+    // }
 
-    Type *Int32Ty = builder.getInt32Ty();
+    if (size == 1)
+      continue;
 
-    int index = Offset;
+    // Computed while the analyses still describe the CFG.
+    auto tripCounts = this->expandTripCounts(F, reverseSTEdges, FAM);
+    auto strides = this->expandStrides(F, reverseSTEdges, FAM);
+
+    // Done first, so that the fast copy is free of counters. The addresses
+    // of blocks taken for an indirectbr would lead the copy back into the
+    // original blocks, so such functions are always counted.
+    bool AddressTaken = any_of(F, [](BasicBlock &BB) {
+      return BB.hasAddressTaken();
+    });
+    if (Sampling && !InProcess && !AddressTaken)
+      this->insertSamplingDispatch(M, F, FAM.getResult<LoopAnalysis>(F));
+
+    auto &slots = Slots[&F];
+    int k = 0;
     for (auto e : reverseSTEdges) {
-      auto indexCst = builder.getInt32(e.getIndex());
-      Value *indexList[] = {builder.getInt32(index++)};
-
-      auto cast = builder.CreateGEP(Int32Ty, IndexArray, indexList);
-      builder.CreateStore(indexCst, cast);
+      indices[slots[k++]] = e.getIndex();
     }
+    descriptors.push_back(
+        this->createFunctionDescriptor(M, F, FunctionOffset[&F], size));
 
-    index = Offset;
+    k = 0;
+    std::vector<AllocaInst *> promoted;
+    std::map<BasicBlock *, std::map<int, int>> dispatches;
     for (auto p : reverseSTEdges) {
-      p.insertIncrFn(index++, CounterArray);
+      int slot = slots[k++];
+      if (AnalysisUtil::isIndexedDispatch(p.getOrigin()))
+        dispatches[p.getOrigin()][p.getIndex()] = slot;
+      else if (p.hasTripCount())
+        p.insertTripCountIncrFn(slot, counters, tripCounts[p.getIndex()]);
+      else if (p.hasStride())
+        p.insertStridedIncrFn(slot, counters, strides[p.getIndex()]);
+      else if (p.isPromotable() &&
+               (PromoteCounters || (AnalysisUtil::isVectorizerFriendly() &&
+                                    p.isInInnermostLoop())))
+        promoted.push_back(p.insertPromotedIncrFn(slot, counters));
+      else
+        p.insertIncrFn(slot, counters);
+    }
+
+    // The edges out of a block are numbered in the order of its successors,
+    // and are all counted by the dispatch.
+    for (auto &[BB, edgeSlots] : dispatches) {
+      std::vector<int> successorSlots;
+      for (auto [index, slot] : edgeSlots)
+        successorSlots.push_back(slot);
+      this->insertDispatchIncr(M, BB, successorSlots, counters);
     }
 
-    if (!DisableProfilePrinting)
-      if (F.getName() == "main")
-        this->insertExitFn(M, F, CounterArray, IndexArray, NumEdges);
+    if (!promoted.empty()) {
+      DominatorTree DT(F);
+      PromoteMemToReg(promoted, DT);
+    }
+
+    // Done after the promotion, as it splits blocks.
+    counters.insertOverflowSpills();
+
+    // Done last, as it splits the entry block.
+    if (ShardFlag)
+      this->insertShardRegistration(M, F);
 
-    Offset += size;
+    // Dispatch counters, and edges in loops without a preheader, can still
+    // leave updates in innermost loops.
+    if (AnalysisUtil::isVectorizerFriendly())
+      this->reportInnermostLoopCounters(M, F);
   }
 
-  return PreservedAnalyses::all();
+  IndexArray->setInitializer(ConstantDataArray::get(Ctx, indices));
+  FunctionTable->setInitializer(
+      ConstantArray::get(FunctionTableType, descriptors));
+
+  // The runtime learns about the module's counters from its descriptor, to
+  // map them in continuous mode, to snapshot them, and to write them when the
+  // module goes away. Each module registers itself, so that several modules,
+  // or shared objects loaded with dlopen, can be profiled together.
+  int flags = (Continuous ? NISSE_MODULE_CONTINUOUS : 0) |
+              (Compact ? NISSE_MODULE_COMPACT : 0) |
+              (DisableProfilePrinting ? NISSE_MODULE_NO_DUMP : 0) |
+              (TotalArray ? NISSE_MODULE_SHARDED : 0);
+  this->insertModuleRegistration(M, Capacity, flags);
+
+  return PreservedAnalyses::none();
+}
+
+PreservedAnalyses NissePass::run(Module &M, ModuleAnalysisManager &MAM) {
+  return this->instrumentModule<NisseAnalysis>(M, MAM);
+}
+
+PreservedAnalyses KSPass::run(Module &M, ModuleAnalysisManager &MAM) {
+  return this->instrumentModule<KSAnalysis>(M, MAM);
 }
 
 } // namespace nisse
@@ -57,7 +57,6 @@ bool registerPipeline(StringRef Name, ModulePassManager &MPM,
   if (Name == "ks") {
     FunctionPassManager FPM;
     FPM.addPass(LoopSimplifyPass());
-    FPM.addPass(BreakCriticalEdgesPass());
 
     MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
     MPM.addPass(nisse::KSPass());
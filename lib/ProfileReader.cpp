@@ -0,0 +1,448 @@
+//===-- ProfileReader.cpp ----------------------------------------------===//
+// Copyright (C) 2023 Leon Frenot
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// This file contains the implementation of the binary profile reader
+///
+//===----------------------------------------------------------------------===//
+
+#include "NisseProfileReader.h"
+#include "NisseProfile.h"
+#include "llvm/Support/MD5.h"
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <algorithm>
+
+using namespace std;
+
+namespace nisse {
+
+uint64_t readLE(const string &buffer, uint64_t offset, int bytes) {
+  uint64_t value = 0;
+  for (int i = bytes - 1; i >= 0; i--) {
+    if (offset + i < buffer.size())
+      value = (value << 8) | (unsigned char)buffer[offset + i];
+    else
+      value <<= 8;
+  }
+  return value;
+}
+
+/// \brief Checks that a range of bytes lies within a limit, without
+/// overflowing when the offset or the length of the range are corrupt.
+/// \param offset The start of the range.
+/// \param length The size of the range.
+/// \param limit The end of the bytes that may be read.
+/// \return true if the range ends before the limit.
+static bool inBounds(uint64_t offset, uint64_t length, uint64_t limit) {
+  return offset <= limit && length <= limit - offset;
+}
+
+bool isBinaryProfile(const string &filename) {
+  ifstream file(filename, ios::binary);
+  char magic[8];
+  if (!file.read(magic, 8))
+    return false;
+  return memcmp(magic, NISSE_PROFILE_MAGIC, 8) == 0;
+}
+
+bool readBinaryProfile(const string &filename,
+                       map<string, EdgeCounts> &functionProfiles) {
+  ifstream file(filename, ios::binary);
+  string buffer((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+  return parseBinaryProfile(buffer, functionProfiles);
+}
+
+bool readBinaryProfile(const string &filename, ModuleProfiles &moduleProfiles) {
+  ifstream file(filename, ios::binary);
+  string buffer((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+  return parseBinaryProfile(buffer, moduleProfiles);
+}
+
+bool parseBinaryProfile(const string &buffer,
+                        map<string, EdgeCounts> &functionProfiles) {
+  ModuleProfiles moduleProfiles;
+  if (!parseBinaryProfile(buffer, moduleProfiles))
+    return false;
+  map<string, map<long long, long long>> sums;
+  for (auto &[module, profiles] : moduleProfiles)
+    for (auto &[name, counts] : profiles)
+      for (auto [idx, count] : counts)
+        sums[name][idx] += count;
+  for (auto &[name, sum] : sums) {
+    functionProfiles[name] = EdgeCounts(sum.begin(), sum.end());
+  }
+  return true;
+}
+
+bool parseBinaryProfile(const string &buffer, ModuleProfiles &moduleProfiles) {
+  map<uint64_t, map<string, map<long long, long long>>> sums;
+  uint64_t record = 0;
+  while (record < buffer.size()) {
+    if (buffer.size() - record < offsetof(nisse_profile_header, module_hash) ||
+        buffer.compare(record, 8, NISSE_PROFILE_MAGIC) != 0)
+      return false;
+    uint64_t version = readLE(buffer, record + 8, 4);
+    uint64_t numFunctions = readLE(buffer, record + 12, 4);
+    uint64_t functionsOffset = readLE(buffer, record + 24, 8);
+    uint64_t namesOffset = readLE(buffer, record + 32, 8);
+    uint64_t indicesOffset = readLE(buffer, record + 40, 8);
+    uint64_t countersOffset = readLE(buffer, record + 48, 8);
+    uint64_t size = readLE(buffer, record + 56, 8);
+    if (size < offsetof(nisse_profile_header, module_hash) ||
+        buffer.size() - record < size)
+      return false;
+    // Version 1 records have no module hash, and are all summed together.
+    uint64_t module = 0;
+    if (version >= 2) {
+      if (size < sizeof(nisse_profile_header))
+        return false;
+      module = readLE(buffer, record + 64, 8);
+    }
+
+    // Every offset is checked against the record, which may be corrupt.
+    if (!inBounds(functionsOffset,
+                  numFunctions * sizeof(nisse_profile_function), size) ||
+        namesOffset > size)
+      return false;
+    for (uint64_t i = 0; i < numFunctions; i++) {
+      uint64_t f =
+          record + functionsOffset + i * sizeof(nisse_profile_function);
+      uint64_t offset = readLE(buffer, f + 8, 4);
+      uint64_t count = readLE(buffer, f + 12, 4);
+      uint64_t nameOffset = readLE(buffer, f + 16, 4);
+      uint64_t nameSize = readLE(buffer, f + 20, 4);
+      if (!inBounds(namesOffset + nameOffset, nameSize, size) ||
+          !inBounds(indicesOffset, 4 * (offset + count), size) ||
+          !inBounds(countersOffset, 8 * (offset + count), size))
+        return false;
+      string name = buffer.substr(record + namesOffset + nameOffset, nameSize);
+      auto &sum = sums[module][name];
+      for (uint64_t j = offset; j < offset + count; j++) {
+        long long idx =
+            (int32_t)readLE(buffer, record + indicesOffset + 4 * j, 4);
+        sum[idx] +=
+            (long long)readLE(buffer, record + countersOffset + 8 * j, 8);
+      }
+    }
+    record += size;
+  }
+
+  for (auto &[module, functions] : sums) {
+    auto &profiles = moduleProfiles[module];
+    for (auto &[name, sum] : functions) {
+      profiles[name] = EdgeCounts(sum.begin(), sum.end());
+    }
+  }
+  return true;
+}
+
+bool readInfoFile(const string &filename, FunctionSizes &functions) {
+  ifstream file(filename);
+  if (!file)
+    return false;
+  string name;
+  int size;
+  while (file >> name >> size)
+    functions.emplace_back(name, size);
+  return true;
+}
+
+bool readTextProfile(const string &filename, const FunctionSizes &functions,
+                     map<string, EdgeCounts> &functionProfiles) {
+  ifstream file(filename);
+  map<string, map<long long, long long>> sums;
+  for (auto &[name, size] : functions)
+    sums[name];
+
+  // Each run appended the counters of every function, in the same order.
+  long long runSize = 0;
+  for (auto &[name, size] : functions)
+    runSize += size;
+
+  long long read = 0, idx, count;
+  while (runSize > 0 && file >> idx >> count) {
+    long long slot = read++ % runSize;
+    for (auto &[name, size] : functions) {
+      if (slot < size) {
+        sums[name][idx] += count;
+        break;
+      }
+      slot -= size;
+    }
+  }
+  bool complete = runSize == 0 || read % runSize == 0;
+
+  for (auto &[name, sum] : sums)
+    functionProfiles[name] = EdgeCounts(sum.begin(), sum.end());
+  return complete;
+}
+
+bool readEdgeFrequencies(const string &filename,
+                         EdgeFrequencies &frequencies) {
+  ifstream file(filename);
+  if (!file)
+    return false;
+
+  // Each run ends with an empty line, and lists the edges in the same order.
+  map<pair<string, string>, size_t> seen;
+  string line;
+  while (getline(file, line)) {
+    if (line.empty()) {
+      seen.clear();
+      continue;
+    }
+    istringstream stream(line);
+    string origin, arrow, dest, colon;
+    long long count;
+    if (!(stream >> origin >> arrow >> dest >> colon >> count) ||
+        arrow != "->" || colon != ":")
+      return false;
+    auto &counts = frequencies[{origin, dest}];
+    size_t n = seen[{origin, dest}]++;
+    if (n == counts.size())
+      counts.push_back(0);
+    counts[n] += count;
+  }
+  return !frequencies.empty();
+}
+
+bool isSnapshotFile(const string &filename) {
+  ifstream file(filename, ios::binary);
+  char magic[8];
+  if (!file.read(magic, 8))
+    return false;
+  return memcmp(magic, NISSE_SNAPSHOT_MAGIC, 8) == 0;
+}
+
+/// \brief Reads a LEB128 integer from a buffer.
+/// \param buffer The buffer to read from.
+/// \param offset The offset of the integer, moved past it.
+/// \return The integer.
+static uint64_t readULEB(const string &buffer, uint64_t &offset) {
+  uint64_t value = 0;
+  for (int shift = 0; offset < buffer.size() && shift < 64; shift += 7) {
+    unsigned char byte = buffer[offset++];
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      break;
+  }
+  return value;
+}
+
+bool readSnapshots(const string &filename, vector<Snapshot> &snapshots) {
+  ifstream file(filename, ios::binary);
+  string buffer((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+  if (buffer.size() < sizeof(nisse_snapshot_header) ||
+      buffer.compare(0, 8, NISSE_SNAPSHOT_MAGIC) != 0)
+    return false;
+
+  uint64_t metadata = readLE(buffer, 16, 8);
+  uint64_t ringOffset = readLE(buffer, 24, 8);
+  uint64_t ringSize = readLE(buffer, 32, 8);
+  uint64_t head = readLE(buffer, 40, 8);
+  uint64_t tail = readLE(buffer, 48, 8);
+  if (ringSize == 0 || !inBounds(ringOffset, ringSize, buffer.size()) ||
+      !inBounds(metadata, sizeof(nisse_profile_header), ringOffset) ||
+      head < tail || head - tail > ringSize)
+    return false;
+
+  // The functions and the edge index of each slot, which lie between the
+  // metadata and the ring.
+  uint64_t numFunctions = readLE(buffer, metadata + 12, 4);
+  uint64_t numSlots = readLE(buffer, metadata + 16, 8);
+  uint64_t metadataSize = ringOffset - metadata;
+  uint64_t functionsOffset = readLE(buffer, metadata + 24, 8);
+  uint64_t namesOffset = readLE(buffer, metadata + 32, 8);
+  uint64_t indicesOffset = readLE(buffer, metadata + 40, 8);
+  if (numSlots > metadataSize / 4 ||
+      !inBounds(indicesOffset, 4 * numSlots, metadataSize) ||
+      !inBounds(functionsOffset,
+                numFunctions * sizeof(nisse_profile_function), metadataSize) ||
+      namesOffset > metadataSize)
+    return false;
+  functionsOffset += metadata;
+  indicesOffset += metadata;
+
+  vector<string> slotFunction(numSlots);
+  vector<long long> slotIndex(numSlots);
+  vector<string> names;
+  for (uint64_t i = 0; i < numFunctions; i++) {
+    uint64_t f = functionsOffset + i * sizeof(nisse_profile_function);
+    uint64_t offset = readLE(buffer, f + 8, 4);
+    uint64_t count = readLE(buffer, f + 12, 4);
+    uint64_t nameOffset = namesOffset + readLE(buffer, f + 16, 4);
+    uint64_t nameSize = readLE(buffer, f + 20, 4);
+    if (!inBounds(nameOffset, nameSize, metadataSize))
+      return false;
+    string name = buffer.substr(metadata + nameOffset, nameSize);
+    names.push_back(name);
+    for (uint64_t j = offset; j < offset + count && j < numSlots; j++) {
+      slotFunction[j] = name;
+      slotIndex[j] = (int32_t)readLE(buffer, indicesOffset + 4 * j, 4);
+    }
+  }
+
+  // The ring, unwrapped from the oldest record.
+  string ring;
+  for (uint64_t position = tail; position < head;) {
+    uint64_t at = position % ringSize;
+    uint64_t length = min(head - position, ringSize - at);
+    ring.append(buffer, ringOffset + at, length);
+    position += length;
+  }
+
+  uint64_t record = 0;
+  while (record < ring.size()) {
+    if (ring.size() - record < sizeof(nisse_snapshot_record))
+      return false;
+    uint64_t size = readLE(ring, record, 4);
+    uint64_t numDeltas = readLE(ring, record + 4, 4);
+    if (size < sizeof(nisse_snapshot_record) || ring.size() - record < size)
+      return false;
+
+    Snapshot snapshot;
+    snapshot.sequence = readLE(ring, record + 8, 8);
+    snapshot.timeNs = readLE(ring, record + 16, 8);
+    map<string, map<long long, long long>> sums;
+    for (auto &name : names)
+      sums[name];
+
+    uint64_t offset = record + sizeof(nisse_snapshot_record);
+    uint64_t slot = 0;
+    for (uint64_t i = 0; i < numDeltas && offset <= record + size; i++) {
+      slot += readULEB(ring, offset) + (i > 0);
+      uint64_t zigzag = readULEB(ring, offset);
+      long long delta = (long long)(zigzag >> 1) ^ -(long long)(zigzag & 1);
+      if (slot < numSlots && !slotFunction[slot].empty())
+        sums[slotFunction[slot]][slotIndex[slot]] += delta;
+    }
+    if (offset > record + size)
+      return false;
+
+    for (auto &[name, sum] : sums)
+      snapshot.functionProfiles[name] = EdgeCounts(sum.begin(), sum.end());
+    snapshots.push_back(move(snapshot));
+    record += size;
+  }
+  return true;
+}
+
+/// \brief Appends a little-endian integer to a buffer.
+/// \param buffer The buffer to append to.
+/// \param value The integer.
+/// \param bytes The size of the integer.
+static void writeLE(string &buffer, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    buffer.push_back((char)(value >> (8 * i)));
+  }
+}
+
+/// \brief Pads a buffer with zeros up to a multiple of 8 bytes.
+/// \param buffer The buffer to pad.
+static void pad8(string &buffer) {
+  buffer.resize((buffer.size() + 7) / 8 * 8, '\0');
+}
+
+void addProfile(ProfileSums &sums,
+                const map<string, EdgeCounts> &functionProfiles,
+                uint64_t module) {
+  for (auto &[name, counts] : functionProfiles) {
+    auto &sum = sums[{module, name}];
+    for (auto [idx, count] : counts)
+      sum[idx] += count;
+  }
+}
+
+void addProfile(ProfileSums &sums, const ModuleProfiles &moduleProfiles) {
+  for (auto &[module, functionProfiles] : moduleProfiles)
+    addProfile(sums, functionProfiles, module);
+}
+
+/// \brief Builds the binary profile record of one module.
+/// \param module The hash of the module.
+/// \param begin The first function of the module in a sum of profiles.
+/// \param end The function after the last one of the module.
+/// \return The record.
+static string buildModuleRecord(uint64_t module,
+                                ProfileSums::const_iterator begin,
+                                ProfileSums::const_iterator end) {
+  string functions, names, indices, counters;
+  uint64_t numCounters = 0, numFunctions = 0;
+  for (auto it = begin; it != end; ++it) {
+    auto &name = it->first.second;
+    auto &counts = it->second;
+    writeLE(functions, llvm::MD5Hash(name), 8);
+    writeLE(functions, numCounters, 4);
+    writeLE(functions, counts.size(), 4);
+    writeLE(functions, names.size(), 4);
+    writeLE(functions, name.size(), 4);
+    names += name;
+    names.push_back('\0');
+    for (auto [idx, count] : counts) {
+      writeLE(indices, idx, 4);
+      writeLE(counters, count, 8);
+    }
+    numCounters += counts.size();
+    numFunctions++;
+  }
+
+  uint64_t functionsOffset = sizeof(nisse_profile_header);
+  uint64_t namesOffset = functionsOffset + functions.size();
+  uint64_t indicesOffset = (namesOffset + names.size() + 7) / 8 * 8;
+  uint64_t countersOffset = (indicesOffset + indices.size() + 7) / 8 * 8;
+  uint64_t size = countersOffset + counters.size();
+
+  string record(NISSE_PROFILE_MAGIC, 8);
+  writeLE(record, NISSE_PROFILE_VERSION, 4);
+  writeLE(record, numFunctions, 4);
+  writeLE(record, numCounters, 8);
+  writeLE(record, functionsOffset, 8);
+  writeLE(record, namesOffset, 8);
+  writeLE(record, indicesOffset, 8);
+  writeLE(record, countersOffset, 8);
+  writeLE(record, size, 8);
+  writeLE(record, module, 8);
+  record += functions;
+  record += names;
+  pad8(record);
+  record += indices;
+  pad8(record);
+  record += counters;
+  return record;
+}
+
+string buildBinaryProfile(const ProfileSums &sums) {
+  if (sums.empty())
+    return buildModuleRecord(0, sums.end(), sums.end());
+  // The sums are sorted by module, so that each module is a range of them.
+  string profile;
+  for (auto begin = sums.begin(); begin != sums.end();) {
+    uint64_t module = begin->first.first;
+    auto end = begin;
+    while (end != sums.end() && end->first.first == module)
+      ++end;
+    profile += buildModuleRecord(module, begin, end);
+    begin = end;
+  }
+  return profile;
+}
+
+} // namespace nisse
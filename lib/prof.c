@@ -1,19 +1,1009 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "NisseProfile.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
-void nisse_pass_print_data(long long *count_array, int *index_array, int size) {
-  if (access("main.prof", F_OK) != 0) {
-    printf("Writing '%s'...\n", "main.prof");
+/* Expands the patterns of a path: %p is replaced by the pid of the process,
+ * %h by the host name, and %% by %. The result is kept in a static buffer,
+ * until the next call. */
+static const char *nisse_expand_path(const char *pattern) {
+  static char path[PATH_MAX];
+  size_t length = 0;
+  for (const char *p = pattern; *p && length < sizeof(path) - 1; p++) {
+    char piece[256] = {*p, 0};
+    if (*p == '%' && p[1]) {
+      p++;
+      if (*p == 'p')
+        snprintf(piece, sizeof(piece), "%d", (int)getpid());
+      else if (*p == 'h' && gethostname(piece, sizeof(piece) - 1) != 0)
+        strcpy(piece, "localhost");
+      else if (*p != 'h')
+        piece[0] = *p;
+    }
+    size_t piece_length = strlen(piece);
+    if (length + piece_length >= sizeof(path))
+      break;
+    memcpy(path + length, piece, piece_length);
+    length += piece_length;
   }
-  FILE *file = fopen("main.prof", "a");
-  if (!file) {
+  path[length] = 0;
+  return path;
+}
+
+/* The profile is written to $NISSE_PROFILE_FILE (main.prof by default), whose
+ * patterns are expanded by nisse_expand_path, so that each process can write
+ * its own file. It is written in the binary format described in
+ * NisseProfile.h, unless $NISSE_PROFILE_FORMAT is "text", in which case each
+ * counter is written as a line with its edge index and its value. Both
+ * formats append to the file. */
+static const char *nisse_profile_path(void) {
+  const char *path = getenv("NISSE_PROFILE_FILE");
+  return nisse_expand_path((path && *path) ? path : "main.prof");
+}
+
+static int nisse_profile_is_text(void) {
+  const char *format = getenv("NISSE_PROFILE_FORMAT");
+  return format && strcmp(format, "text") == 0;
+}
+
+static void nisse_store_le(unsigned char *p, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++)
+    p[i] = (unsigned char)(value >> (8 * i));
+}
+
+static uint64_t nisse_align(uint64_t value, uint64_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+static uint64_t nisse_align8(uint64_t value) { return nisse_align(value, 8); }
+
+/* The FNV-1a hash of the name of a module, which tells the records of
+ * different modules apart when they are summed. */
+static uint64_t nisse_module_hash(const char *name) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (const char *p = name ? name : ""; *p; p++)
+    hash = (hash ^ (unsigned char)*p) * 0x100000001b3ull;
+  return hash;
+}
+
+/* Builds the header, the function records and the names of a binary profile
+ * record, which are followed by the indices and the counters. The counters
+ * start at a multiple of counters_align, and the record has room for capacity
+ * of them. Returns the size of the buffer stored in *out, or 0 on failure. */
+static size_t nisse_profile_metadata(unsigned char **out,
+                                     const char *module_name,
+                                     const struct nisse_function *functions,
+                                     int num_functions, int size, int capacity,
+                                     uint64_t counters_align) {
+  uint64_t names_size = 0;
+  for (int i = 0; i < num_functions; i++)
+    names_size += strlen(functions[i].name) + 1;
+
+  uint64_t functions_offset = sizeof(struct nisse_profile_header);
+  uint64_t names_offset = functions_offset +
+                          num_functions * sizeof(struct nisse_profile_function);
+  uint64_t indices_offset = nisse_align8(names_offset + names_size);
+  uint64_t counters_offset =
+      nisse_align(indices_offset + 4ull * size, counters_align);
+  uint64_t record_size = counters_offset + 8ull * capacity;
+
+  unsigned char *buffer = calloc(indices_offset, 1);
+  if (!buffer)
+    return 0;
+
+  unsigned char *h = buffer;
+  memcpy(h, NISSE_PROFILE_MAGIC, 8);
+  nisse_store_le(h + 8, NISSE_PROFILE_VERSION, 4);
+  nisse_store_le(h + 12, num_functions, 4);
+  nisse_store_le(h + 16, size, 8);
+  nisse_store_le(h + 24, functions_offset, 8);
+  nisse_store_le(h + 32, names_offset, 8);
+  nisse_store_le(h + 40, indices_offset, 8);
+  nisse_store_le(h + 48, counters_offset, 8);
+  nisse_store_le(h + 56, record_size, 8);
+  nisse_store_le(h + 64, nisse_module_hash(module_name), 8);
+
+  uint64_t name_offset = 0;
+  for (int i = 0; i < num_functions; i++) {
+    unsigned char *f =
+        buffer + functions_offset + i * sizeof(struct nisse_profile_function);
+    uint64_t name_size = strlen(functions[i].name);
+    nisse_store_le(f, functions[i].hash, 8);
+    nisse_store_le(f + 8, functions[i].offset, 4);
+    nisse_store_le(f + 12, functions[i].size, 4);
+    nisse_store_le(f + 16, name_offset, 4);
+    nisse_store_le(f + 20, name_size, 4);
+    memcpy(buffer + names_offset + name_offset, functions[i].name, name_size);
+    name_offset += name_size + 1;
+  }
+
+  *out = buffer;
+  return indices_offset;
+}
+
+/* Writes all the buffers. On a socket, they are sent with MSG_NOSIGNAL, so
+ * that an aggregator that goes away fails the write with EPIPE, instead of
+ * killing the program with SIGPIPE before it falls back to the file. */
+static int nisse_writev_all(int fd, struct iovec *iov, int count,
+                            int is_socket) {
+  while (count > 0) {
+    ssize_t written;
+    if (is_socket) {
+      struct msghdr message = {.msg_iov = iov,
+                               .msg_iovlen = count > IOV_MAX ? IOV_MAX : count};
+      written = sendmsg(fd, &message, MSG_NOSIGNAL);
+    } else {
+      written = writev(fd, iov, count > IOV_MAX ? IOV_MAX : count);
+    }
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    while (count > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+/* Writes a whole binary profile record with a single writev, or sendmsg if
+ * fd is a socket. */
+static int nisse_write_binary(int fd, long long *count_array, int *index_array,
+                              int size, const struct nisse_function *functions,
+                              int num_functions, const char *module_name,
+                              int is_socket) {
+  unsigned char *metadata;
+  size_t metadata_size = nisse_profile_metadata(
+      &metadata, module_name, functions, num_functions, size, size, 8);
+  if (metadata_size == 0)
+    return -1;
+
+  static const char padding[8];
+  size_t indices_size = 4ull * size;
+  void *indices = index_array, *counters = count_array;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  indices = malloc(indices_size + 1);
+  counters = malloc(8ull * size + 1);
+  if (!indices || !counters) {
+    free(indices);
+    free(counters);
+    free(metadata);
+    return -1;
+  }
+  for (int i = 0; i < size; i++) {
+    nisse_store_le((unsigned char *)indices + 4ull * i, index_array[i], 4);
+    nisse_store_le((unsigned char *)counters + 8ull * i, count_array[i], 8);
+  }
+#endif
+
+  struct iovec iov[4] = {
+      {metadata, metadata_size},
+      {indices, indices_size},
+      {(void *)padding, nisse_align8(indices_size) - indices_size},
+      {counters, 8ull * size},
+  };
+  int result = nisse_writev_all(fd, iov, 4, is_socket);
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  free(indices);
+  free(counters);
+#endif
+  free(metadata);
+  return result;
+}
+
+/* The text format lists the counters function by function, in the order of
+ * the function table, which skips the padding between the functions. */
+static void nisse_print_text(FILE *file, long long *count_array,
+                             int *index_array,
+                             const struct nisse_function *functions,
+                             int num_functions) {
+  static char buffer[1 << 16];
+  setvbuf(file, buffer, _IOFBF, sizeof(buffer));
+  for (int f = 0; f < num_functions; f++) {
+    int end = functions[f].offset + functions[f].size;
+    for (int i = functions[f].offset; i < end; i++) {
+      fprintf(file, "%d %Ld\n", index_array[i], count_array[i]);
+    }
+  }
+}
+
+/* With $NISSE_PROFILE_SOCKET, the binary record is sent to the aggregator
+ * listening on that Unix socket (see nisse-aggregator), instead of being
+ * appended to the profile file. If the aggregator cannot be reached, the
+ * profile is written to the file as usual. */
+static int nisse_send_binary(const char *socket_path, long long *count_array,
+                             int *index_array, int size,
+                             const struct nisse_function *functions,
+                             int num_functions, const char *module_name) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(address.sun_path))
+    return -1;
+  strcpy(address.sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  int result = connect(fd, (struct sockaddr *)&address, sizeof(address));
+  if (result == 0)
+    result = nisse_write_binary(fd, count_array, index_array, size, functions,
+                                num_functions, module_name, 1);
+  close(fd);
+  return result;
+}
+
+void nisse_pass_print_data(long long *count_array, int *index_array, int size,
+                           const struct nisse_function *functions,
+                           int num_functions, const char *module_name) {
+  const char *socket_path = getenv("NISSE_PROFILE_SOCKET");
+  if (socket_path && *socket_path && !nisse_profile_is_text()) {
+    if (nisse_send_binary(socket_path, count_array, index_array, size,
+                          functions, num_functions, module_name) == 0)
+      return;
+    perror("Could not send the profile to the aggregator");
+  }
+
+  const char *path = nisse_profile_path();
+  if (access(path, F_OK) != 0) {
+    printf("Writing '%s'...\n", path);
+  }
+
+  if (nisse_profile_is_text()) {
+    FILE *file = fopen(path, "a");
+    if (!file) {
+      perror("Could not open file");
+      return;
+    }
+    nisse_print_text(file, count_array, index_array, functions, num_functions);
+    fclose(file);
+    return;
+  }
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
     perror("Could not open file");
     return;
   }
-  
-  for (int i = 0; i < size; i++) {
-    fprintf(file, "%d %Ld\n", index_array[i], count_array[i]);
-  } 
-  fclose(file);
-}
\ No newline at end of file
+  if (nisse_write_binary(fd, count_array, index_array, size, functions,
+                         num_functions, module_name, 0) != 0)
+    perror("Could not write profile");
+  close(fd);
+}
+
+/* Used when the program is instrumented with -nisse-compact-counters: the
+ * counters are 32 bits wide, and spill[i] holds the carries out of
+ * count_array[i]. */
+void nisse_pass_print_compact_data(unsigned *count_array, long long *spill,
+                                   int *index_array, int size,
+                                   const struct nisse_function *functions,
+                                   int num_functions,
+                                   const char *module_name) {
+  long long *counters = malloc(size * sizeof(long long) + 1);
+  if (!counters) {
+    perror("Could not allocate counters");
+    return;
+  }
+  for (int i = 0; i < size; i++)
+    counters[i] = (long long)((unsigned long long)spill[i] << 32) +
+                  count_array[i];
+  nisse_pass_print_data(counters, index_array, size, functions, num_functions,
+                        module_name);
+  free(counters);
+}
+
+/* Counter shards, used when the program is instrumented with
+ * -nisse-counter-mode=sharded. Each thread increments its own thread-local
+ * copy of the counter-array of each module, which is added to the total array
+ * when the thread exits, or when the profile is printed. The shards of a
+ * thread are chained through thread_next. */
+struct nisse_shard {
+  long long *counters;
+  long long *total;
+  int size;
+  struct nisse_shard *next;
+  struct nisse_shard *thread_next;
+};
+
+static pthread_mutex_t nisse_shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t nisse_shards_once = PTHREAD_ONCE_INIT;
+static pthread_key_t nisse_shards_key;
+static struct nisse_shard *nisse_shards = NULL;
+
+static void nisse_shard_merge(struct nisse_shard *shard) {
+  for (int i = 0; i < shard->size; i++) {
+    if (shard->counters[i] == 0)
+      continue;
+    __atomic_fetch_add(&shard->total[i], shard->counters[i], __ATOMIC_RELAXED);
+    shard->counters[i] = 0;
+  }
+}
+
+static void nisse_shard_exit(void *data) {
+  pthread_mutex_lock(&nisse_shards_lock);
+  for (struct nisse_shard *shard = data, *next; shard; shard = next) {
+    next = shard->thread_next;
+    for (struct nisse_shard **it = &nisse_shards; *it; it = &(*it)->next) {
+      if (*it == shard) {
+        *it = shard->next;
+        break;
+      }
+    }
+    nisse_shard_merge(shard);
+    free(shard);
+  }
+  pthread_mutex_unlock(&nisse_shards_lock);
+}
+
+static pthread_once_t nisse_fork_once = PTHREAD_ONCE_INIT;
+static void nisse_fork_init(void);
+
+static void nisse_shards_init(void) {
+  pthread_key_create(&nisse_shards_key, nisse_shard_exit);
+  pthread_once(&nisse_fork_once, nisse_fork_init);
+}
+
+void nisse_pass_register_shard(long long *counters, long long *total,
+                               int size) {
+  struct nisse_shard *shard = malloc(sizeof(struct nisse_shard));
+  if (!shard) {
+    perror("Could not register counter shard");
+    return;
+  }
+  shard->counters = counters;
+  shard->total = total;
+  shard->size = size;
+
+  pthread_once(&nisse_shards_once, nisse_shards_init);
+  pthread_mutex_lock(&nisse_shards_lock);
+  shard->next = nisse_shards;
+  nisse_shards = shard;
+  pthread_mutex_unlock(&nisse_shards_lock);
+  shard->thread_next = pthread_getspecific(nisse_shards_key);
+  pthread_setspecific(nisse_shards_key, shard);
+}
+
+/* Adds the shards of the threads that are still alive to the total array.
+ * Those threads are expected to be done with the instrumented code. */
+void nisse_pass_merge_shards(long long *total, int size) {
+  pthread_mutex_lock(&nisse_shards_lock);
+  for (struct nisse_shard *shard = nisse_shards; shard; shard = shard->next) {
+    if (shard->total == total)
+      nisse_shard_merge(shard);
+  }
+  pthread_mutex_unlock(&nisse_shards_lock);
+}
+
+/* Merges the shards of a module that is being unloaded, and detaches them:
+ * their thread-local counters go away with the module, and they are only
+ * freed when their threads exit. */
+static void nisse_detach_shards(long long *total) {
+  pthread_mutex_lock(&nisse_shards_lock);
+  for (struct nisse_shard **it = &nisse_shards; *it;) {
+    struct nisse_shard *shard = *it;
+    if (shard->total != total) {
+      it = &shard->next;
+      continue;
+    }
+    nisse_shard_merge(shard);
+    shard->size = 0;
+    *it = shard->next;
+  }
+  pthread_mutex_unlock(&nisse_shards_lock);
+}
+
+/* Continuous mode, used when the program is instrumented with
+ * -nisse-continuous. The page-aligned counter-array is mapped onto the
+ * counters of a single record in the profile file, so the profile is always
+ * up to date, even if the program crashes. If the file already holds a record
+ * with the same layout, the counters keep accumulating from its values. The
+ * file is locked while the program runs; if another process holds the lock,
+ * or if the file holds other profiles, the profile goes to a file suffixed
+ * with the pid instead. */
+
+static int nisse_open_unique(const char *path) {
+  char unique_path[PATH_MAX];
+  snprintf(unique_path, sizeof(unique_path), "%s.%d", path, (int)getpid());
+  int fd = open(unique_path, O_RDWR | O_CREAT, 0644);
+  if (fd >= 0)
+    flock(fd, LOCK_EX);
+  return fd;
+}
+
+static int nisse_open_locked(const char *path) {
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    return -1;
+  if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+    return fd;
+  close(fd);
+  return nisse_open_unique(path);
+}
+
+/* With $NISSE_PROFILE_SHM, the record lives in a POSIX shared memory segment
+ * of that name instead, where tools such as nisse-top can read the counters
+ * while the program runs. The segment is created anew, and removed when the
+ * module is unregistered, once the profile has been appended to the profile
+ * file as usual. A segment of that name that already exists, e.g. the one of
+ * another run, is left alone, and the counters go to the profile file. */
+static int nisse_open_shm(const char *name) {
+  return shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+}
+
+/* Maps the counters of the module onto the record held by fd, which is
+ * initialized if it is empty. Returns 1, leaving the file untouched, if it
+ * holds anything but a record with the same layout. */
+static int nisse_map_counters(const struct nisse_module *module, int fd) {
+  long page = sysconf(_SC_PAGESIZE);
+  uint64_t counters_size = 8ull * module->capacity;
+  if ((uintptr_t)module->counters % page != 0 || counters_size % page != 0) {
+    fprintf(stderr,
+            "Warning: counters are not aligned on pages of %ld bytes, "
+            "continuous mode is off (see -nisse-continuous-page-size)\n",
+            page);
+    return -1;
+  }
+
+  unsigned char *metadata;
+  size_t metadata_size = nisse_profile_metadata(
+      &metadata, module->name, module->functions, module->num_functions,
+      module->size, module->capacity, page);
+  if (metadata_size == 0)
+    return -1;
+  uint64_t indices_size = 4ull * module->size;
+  uint64_t counters_offset = nisse_align(metadata_size + indices_size, page);
+  uint64_t file_size = counters_offset + counters_size;
+
+  /* Reuse the record of a previous run if it has the same layout. */
+  int reuse = 0;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    perror("Could not initialize profile");
+    free(metadata);
+    return -1;
+  }
+  if ((uint64_t)st.st_size == file_size) {
+    unsigned char *previous = malloc(metadata_size + indices_size + 1);
+    if (previous &&
+        pread(fd, previous, metadata_size + indices_size, 0) ==
+            (ssize_t)(metadata_size + indices_size) &&
+        memcmp(previous, metadata, metadata_size) == 0 &&
+        memcmp(previous + metadata_size, module->indices, indices_size) == 0)
+      reuse = 1;
+    free(previous);
+  }
+
+  if (!reuse && st.st_size != 0) {
+    free(metadata);
+    return 1;
+  }
+  if (!reuse) {
+    if (ftruncate(fd, file_size) != 0 ||
+        pwrite(fd, metadata, metadata_size, 0) != (ssize_t)metadata_size ||
+        pwrite(fd, module->indices, indices_size, metadata_size) !=
+            (ssize_t)indices_size) {
+      perror("Could not initialize profile");
+      free(metadata);
+      return -1;
+    }
+  }
+  free(metadata);
+
+  /* Counts taken before the mapping, e.g. by other constructors, are kept. */
+  long long *early = malloc(counters_size);
+  if (early)
+    memcpy(early, module->counters, counters_size);
+
+  void *mapped = mmap(module->counters, counters_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED, fd, counters_offset);
+  if (mapped == MAP_FAILED) {
+    perror("Could not map profile");
+    free(early);
+    return -1;
+  }
+
+  if (early) {
+    for (int i = 0; i < module->size; i++)
+      module->counters[i] += early[i];
+    free(early);
+  }
+
+  return 0;
+}
+
+/* The modules registered by their constructors. Only the first module in
+ * continuous mode is mapped onto the profile file, or segment: the next ones
+ * are mapped onto names suffixed with the name of their module. */
+struct nisse_registration {
+  const struct nisse_module *module;
+  int mapped;
+  int suffixed;
+  int fd;
+  char *shm;
+  struct nisse_registration *next;
+};
+
+static pthread_mutex_t nisse_modules_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct nisse_registration *nisse_modules = NULL;
+
+static const char *nisse_module_path(const char *path,
+                                     const struct nisse_registration *r) {
+  static char module_path[PATH_MAX];
+  if (!r->suffixed)
+    return path;
+  const char *name = r->module->name ? r->module->name : "module";
+  const char *base = strrchr(name, '/');
+  snprintf(module_path, sizeof(module_path), "%s.%s", path,
+           base ? base + 1 : name);
+  return module_path;
+}
+
+/* Returns 1 if the counters of the module are mapped. Otherwise, the profile
+ * is written when the module is unregistered. */
+static int nisse_map_module(struct nisse_registration *r) {
+  const struct nisse_module *module = r->module;
+
+  const char *shm = getenv("NISSE_PROFILE_SHM");
+  if (shm && *shm) {
+    shm = nisse_module_path(shm, r);
+    int fd = nisse_open_shm(shm);
+    if (fd >= 0 && nisse_map_counters(module, fd) == 0) {
+      close(fd);
+      r->shm = strdup(shm);
+      return 1;
+    }
+    perror("Could not export the counters in shared memory");
+    if (fd >= 0) {
+      close(fd);
+      shm_unlink(shm);
+    }
+  }
+
+  /* The descriptor stays open, so that the lock is held until the module is
+   * unregistered. */
+  const char *path = nisse_module_path(nisse_profile_path(), r);
+  int fd = nisse_open_locked(path);
+  if (fd < 0)
+    perror("Could not open profile, continuous mode is off");
+  int status = fd >= 0 ? nisse_map_counters(module, fd) : -1;
+  if (status > 0) {
+    close(fd);
+    fd = nisse_open_unique(path);
+    status = fd >= 0 ? nisse_map_counters(module, fd) : -1;
+  }
+  if (status == 0) {
+    r->fd = fd;
+    return 1;
+  }
+  if (status > 0)
+    fprintf(stderr,
+            "Profile file has another layout, continuous mode is off\n");
+  if (fd >= 0)
+    close(fd);
+  return 0;
+}
+
+/* Snapshots, taken when $NISSE_SNAPSHOT_INTERVAL is a number of milliseconds.
+ * A background thread then records, at each interval, the increase of every
+ * counter that changed, in the ring buffer of $NISSE_SNAPSHOT_FILE
+ * (main.snapshots by default), whose layout is described in NisseProfile.h.
+ * The ring holds $NISSE_SNAPSHOT_SIZE bytes (1 MiB by default), and the
+ * oldest records are dropped to make room for new ones. A last snapshot is
+ * taken at exit. */
+struct nisse_snapshots {
+  const struct nisse_module *module;
+  long long *last;
+  unsigned char *buffer;
+  int fd;
+  unsigned interval_ms;
+  uint64_t ring_offset, ring_size, head, tail, sequence;
+  struct timespec start;
+  pthread_mutex_t lock;
+  int stopped;
+};
+
+static struct nisse_snapshots nisse_snapshots = {
+    .lock = PTHREAD_MUTEX_INITIALIZER};
+
+static long long nisse_module_counter(const struct nisse_module *module,
+                                      int i) {
+  if (module->flags & NISSE_MODULE_COMPACT) {
+    uint32_t low = __atomic_load_n((uint32_t *)module->counters + i,
+                                   __ATOMIC_RELAXED);
+    long long high = __atomic_load_n(module->spill + i, __ATOMIC_RELAXED);
+    return (long long)(((unsigned long long)high << 32) + low);
+  }
+  return __atomic_load_n(module->counters + i, __ATOMIC_RELAXED);
+}
+
+static unsigned char *nisse_store_uleb(unsigned char *p, uint64_t value) {
+  do {
+    unsigned char byte = value & 0x7f;
+    value >>= 7;
+    *p++ = byte | (value ? 0x80 : 0);
+  } while (value);
+  return p;
+}
+
+static const unsigned char *nisse_load_uleb(const unsigned char *p,
+                                            uint64_t *value) {
+  *value = 0;
+  for (int shift = 0;; shift += 7) {
+    unsigned char byte = *p++;
+    *value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return p;
+  }
+}
+
+static void nisse_ring_access(struct nisse_snapshots *s, void *data,
+                              uint64_t size, uint64_t position, int write) {
+  uint64_t at = position % s->ring_size;
+  uint64_t first = size < s->ring_size - at ? size : s->ring_size - at;
+  uint64_t parts[2][3] = {{0, first, at}, {first, size - first, 0}};
+  for (int i = 0; i < 2; i++) {
+    if (parts[i][1] == 0)
+      continue;
+    unsigned char *p = (unsigned char *)data + parts[i][0];
+    off_t offset = s->ring_offset + parts[i][2];
+    ssize_t done = write ? pwrite(s->fd, p, parts[i][1], offset)
+                         : pread(s->fd, p, parts[i][1], offset);
+    if (done != (ssize_t)parts[i][1])
+      memset(p, 0, parts[i][1]);
+  }
+}
+
+static void nisse_take_snapshot(struct nisse_snapshots *s) {
+  const struct nisse_module *module = s->module;
+  unsigned char *p = s->buffer + sizeof(struct nisse_snapshot_record);
+  uint32_t num_deltas = 0;
+  int previous = -1;
+  for (int i = 0; i < module->size; i++) {
+    long long value = nisse_module_counter(module, i);
+    long long delta = value - s->last[i];
+    if (delta == 0)
+      continue;
+    p = nisse_store_uleb(p, i - previous - 1);
+    p = nisse_store_uleb(p, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+    previous = i;
+    num_deltas++;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t time_ns = (now.tv_sec - s->start.tv_sec) * 1000000000ull +
+                     now.tv_nsec - s->start.tv_nsec;
+  uint32_t size = p - s->buffer;
+  nisse_store_le(s->buffer, size, 4);
+  nisse_store_le(s->buffer + 4, num_deltas, 4);
+  nisse_store_le(s->buffer + 8, s->sequence + 1, 8);
+  nisse_store_le(s->buffer + 16, time_ns, 8);
+  /* The counts of a snapshot that does not fit are left to the next one. */
+  if (size > s->ring_size) {
+    fprintf(stderr, "Snapshot %llu does not fit in the ring buffer\n",
+            (unsigned long long)s->sequence + 1);
+    return;
+  }
+
+  /* Drops the oldest records, then writes the new one, and publishes it. */
+  unsigned char word[8];
+  while (s->head + size - s->tail > s->ring_size) {
+    unsigned char dropped[4];
+    nisse_ring_access(s, dropped, 4, s->tail, 0);
+    uint64_t dropped_size = dropped[0] | dropped[1] << 8 | dropped[2] << 16 |
+                            (uint64_t)dropped[3] << 24;
+    s->tail = dropped_size ? s->tail + dropped_size : s->head;
+  }
+  nisse_store_le(word, s->tail, 8);
+  pwrite(s->fd, word, 8, offsetof(struct nisse_snapshot_header, tail));
+  nisse_ring_access(s, s->buffer, size, s->head, 1);
+  s->head += size;
+  nisse_store_le(word, s->head, 8);
+  pwrite(s->fd, word, 8, offsetof(struct nisse_snapshot_header, head));
+
+  /* The counts of the record, now in the ring, are the next baseline. */
+  s->sequence++;
+  const unsigned char *q = s->buffer + sizeof(struct nisse_snapshot_record);
+  int i = -1;
+  for (uint32_t j = 0; j < num_deltas; j++) {
+    uint64_t gap, zigzag;
+    q = nisse_load_uleb(q, &gap);
+    q = nisse_load_uleb(q, &zigzag);
+    i += gap + 1;
+    s->last[i] += (long long)(zigzag >> 1) ^ -(long long)(zigzag & 1);
+  }
+}
+
+static void *nisse_snapshot_thread(void *data) {
+  struct nisse_snapshots *s = data;
+  struct timespec interval = {s->interval_ms / 1000,
+                              (s->interval_ms % 1000) * 1000000l};
+  for (;;) {
+    nanosleep(&interval, NULL);
+    pthread_mutex_lock(&s->lock);
+    int stopped = s->stopped;
+    if (!stopped)
+      nisse_take_snapshot(s);
+    pthread_mutex_unlock(&s->lock);
+    if (stopped)
+      return NULL;
+  }
+}
+
+static void nisse_stop_snapshots(void) {
+  struct nisse_snapshots *s = &nisse_snapshots;
+  pthread_mutex_lock(&s->lock);
+  if (!s->stopped) {
+    nisse_take_snapshot(s);
+    s->stopped = 1;
+    close(s->fd);
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+static void nisse_start_snapshots(const struct nisse_module *module,
+                                  unsigned interval_ms) {
+  struct nisse_snapshots *s = &nisse_snapshots;
+  if (s->module) {
+    fprintf(stderr, "Snapshots are already taken for another module\n");
+    return;
+  }
+
+  const char *path = getenv("NISSE_SNAPSHOT_FILE");
+  path = nisse_expand_path(path && *path ? path : "main.snapshots");
+  const char *ring_size = getenv("NISSE_SNAPSHOT_SIZE");
+  s->ring_size = ring_size && atoll(ring_size) > 0 ? atoll(ring_size) : 1 << 20;
+
+  unsigned char *metadata;
+  size_t metadata_size = nisse_profile_metadata(
+      &metadata, module->name, module->functions, module->num_functions,
+      module->size, 0, 8);
+  if (metadata_size == 0)
+    return;
+  uint64_t indices_size = 4ull * module->size;
+  uint64_t metadata_offset = sizeof(struct nisse_snapshot_header);
+  s->ring_offset =
+      metadata_offset + nisse_align8(metadata_size + indices_size);
+
+  unsigned char header[sizeof(struct nisse_snapshot_header)] = {0};
+  memcpy(header, NISSE_SNAPSHOT_MAGIC, 8);
+  nisse_store_le(header + 8, NISSE_SNAPSHOT_VERSION, 4);
+  nisse_store_le(header + 12, interval_ms, 4);
+  nisse_store_le(header + 16, metadata_offset, 8);
+  nisse_store_le(header + 24, s->ring_offset, 8);
+  nisse_store_le(header + 32, s->ring_size, 8);
+
+  s->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  s->last = calloc(module->size + 1, sizeof(long long));
+  s->buffer = malloc(sizeof(struct nisse_snapshot_record) + 15ull * module->size);
+  if (s->fd < 0 || !s->last || !s->buffer ||
+      ftruncate(s->fd, s->ring_offset + s->ring_size) != 0 ||
+      pwrite(s->fd, header, sizeof(header), 0) != sizeof(header) ||
+      pwrite(s->fd, metadata, metadata_size, metadata_offset) !=
+          (ssize_t)metadata_size ||
+      pwrite(s->fd, module->indices, indices_size,
+             metadata_offset + metadata_size) != (ssize_t)indices_size) {
+    perror("Could not create snapshot file");
+    if (s->fd >= 0)
+      close(s->fd);
+    free(metadata);
+    return;
+  }
+  free(metadata);
+
+  s->module = module;
+  s->interval_ms = interval_ms;
+  clock_gettime(CLOCK_MONOTONIC, &s->start);
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, nisse_snapshot_thread, s) != 0) {
+    perror("Could not start snapshot thread");
+    return;
+  }
+  pthread_detach(thread);
+  atexit(nisse_stop_snapshots);
+}
+
+/* After a fork, the child starts with counters of its own, all zero, so
+ * that the counts of the parent are not written twice. Mapped counters are
+ * shared with the parent: the child replaces them with private pages, and maps
+ * them again, onto its own file. The snapshot thread does not survive fork,
+ * and the child takes no snapshots. */
+static void nisse_fork_prepare(void) {
+  pthread_mutex_lock(&nisse_modules_lock);
+  pthread_mutex_lock(&nisse_shards_lock);
+  pthread_mutex_lock(&nisse_snapshots.lock);
+}
+
+static void nisse_fork_parent(void) {
+  pthread_mutex_unlock(&nisse_snapshots.lock);
+  pthread_mutex_unlock(&nisse_shards_lock);
+  pthread_mutex_unlock(&nisse_modules_lock);
+}
+
+static void nisse_fork_child(void) {
+  if (nisse_snapshots.module && !nisse_snapshots.stopped) {
+    nisse_snapshots.stopped = 1;
+    close(nisse_snapshots.fd);
+  }
+
+  for (struct nisse_shard *shard = nisse_shards; shard; shard = shard->next) {
+    memset(shard->counters, 0, shard->size * sizeof(long long));
+    memset(shard->total, 0, shard->size * sizeof(long long));
+  }
+
+  for (struct nisse_registration *r = nisse_modules; r; r = r->next) {
+    const struct nisse_module *module = r->module;
+    size_t width = module->flags & NISSE_MODULE_COMPACT ? 4 : 8;
+    if (r->mapped) {
+      mmap(module->counters, 8ull * module->capacity, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+      if (r->fd >= 0)
+        close(r->fd);
+      r->fd = -1;
+      /* The segment belongs to the parent. */
+      free(r->shm);
+      r->shm = NULL;
+      r->mapped = getenv("NISSE_PROFILE_SHM") ? 0 : nisse_map_module(r);
+    } else {
+      memset(module->counters, 0, width * module->capacity);
+    }
+    if (module->spill)
+      memset(module->spill, 0, 8ull * module->size);
+  }
+
+  nisse_fork_parent();
+}
+
+static void nisse_fork_init(void) {
+  pthread_atfork(nisse_fork_prepare, nisse_fork_parent, nisse_fork_child);
+}
+
+void nisse_pass_register_module(const struct nisse_module *module) {
+  struct nisse_registration *registration =
+      calloc(1, sizeof(struct nisse_registration));
+  if (!registration) {
+    perror("Could not register module");
+    return;
+  }
+  registration->module = module;
+  registration->fd = -1;
+
+  pthread_once(&nisse_fork_once, nisse_fork_init);
+  pthread_mutex_lock(&nisse_modules_lock);
+  for (struct nisse_registration *r = nisse_modules; r; r = r->next) {
+    if (r->module->flags & NISSE_MODULE_CONTINUOUS)
+      registration->suffixed = 1;
+  }
+  if (module->flags & NISSE_MODULE_CONTINUOUS)
+    registration->mapped = nisse_map_module(registration);
+  registration->next = nisse_modules;
+  nisse_modules = registration;
+  pthread_mutex_unlock(&nisse_modules_lock);
+
+  const char *interval = getenv("NISSE_SNAPSHOT_INTERVAL");
+  if (interval && atoi(interval) > 0 && !(module->flags & NISSE_MODULE_SHARDED))
+    nisse_start_snapshots(module, atoi(interval));
+}
+
+/* Writes the profile of a module that is not mapped. */
+static void nisse_dump_module(const struct nisse_module *module) {
+  if (module->flags & NISSE_MODULE_NO_DUMP)
+    return;
+  if (module->flags & NISSE_MODULE_SHARDED)
+    nisse_pass_merge_shards(module->counters, module->size);
+  if (module->flags & NISSE_MODULE_COMPACT)
+    nisse_pass_print_compact_data((unsigned *)module->counters, module->spill,
+                                  module->indices, module->size,
+                                  module->functions, module->num_functions,
+                                  module->name);
+  else
+    nisse_pass_print_data(module->counters, module->indices, module->size,
+                          module->functions, module->num_functions,
+                          module->name);
+}
+
+void nisse_dump_profile(void) {
+  pthread_mutex_lock(&nisse_modules_lock);
+  for (struct nisse_registration *r = nisse_modules; r; r = r->next) {
+    const struct nisse_module *module = r->module;
+    if (module->flags & (NISSE_MODULE_CONTINUOUS | NISSE_MODULE_NO_DUMP))
+      continue;
+    nisse_dump_module(module);
+    size_t width = module->flags & NISSE_MODULE_COMPACT ? 4 : 8;
+    memset(module->counters, 0, width * module->capacity);
+    if (module->spill)
+      memset(module->spill, 0, 8ull * module->size);
+  }
+  pthread_mutex_unlock(&nisse_modules_lock);
+}
+
+/* Called by the destructor of a module, when the program exits or when the
+ * shared object holding the module is unloaded with dlclose: writes its
+ * profile, unless its counters are mapped onto the profile file, and forgets
+ * about it. */
+void nisse_pass_unregister_module(const struct nisse_module *module) {
+  pthread_mutex_lock(&nisse_modules_lock);
+  struct nisse_registration *registration = NULL;
+  for (struct nisse_registration **it = &nisse_modules; *it;
+       it = &(*it)->next) {
+    if ((*it)->module == module) {
+      registration = *it;
+      *it = registration->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&nisse_modules_lock);
+  if (!registration)
+    return;
+
+  if (nisse_snapshots.module == module)
+    nisse_stop_snapshots();
+  if (module->flags & NISSE_MODULE_SHARDED)
+    nisse_detach_shards(module->counters);
+
+  if (!registration->mapped || registration->shm)
+    nisse_dump_module(module);
+  if (registration->shm)
+    shm_unlink(registration->shm);
+  if (registration->fd >= 0)
+    close(registration->fd);
+  free(registration->shm);
+  free(registration);
+}
+
+/* Sampling, used when the program is instrumented with -nisse-sampling. Each
+ * instrumented function then has a fast copy without counters, besides the
+ * copy with counters. Calls to these functions and the back edges of their fast
+ * copies decrement nisse_sample_countdown, and a call that brings it to zero
+ * or below runs the copy with counters, and resets the countdown to
+ * nisse_sample_period. A period of zero disables sampling. The countdown is
+ * shared by the threads, and updated without synchronization: a lost update
+ * only shifts the next sample. */
+int nisse_sample_period = 1000;
+int nisse_sample_countdown = 1;
+static int nisse_sample_saved_period = 1000;
+
+__attribute__((constructor)) static void nisse_sample_init(void) {
+  const char *period = getenv("NISSE_SAMPLE_PERIOD");
+  if (period && *period)
+    nisse_sample_set_period(atoi(period));
+}
+
+void nisse_sample_set_period(int period) {
+  if (period < 0)
+    period = 0;
+  nisse_sample_saved_period = period;
+  nisse_sample_enable(period != 0);
+}
+
+void nisse_sample_enable(int enable) {
+  if (enable && nisse_sample_saved_period > 0) {
+    nisse_sample_period = nisse_sample_saved_period;
+    nisse_sample_countdown = nisse_sample_period;
+  } else {
+    nisse_sample_period = 0;
+    nisse_sample_countdown = INT_MAX;
+  }
+}
@@ -60,7 +60,7 @@ $LLVM_OPT -S -passes="mem2reg,instnamer" $LL_NAME -o $LL_NAME
 
 # Running the pass:
 #
-$LLVM_OPT -S -passes="loop-simplify,break-crit-edges" $LL_NAME -o $LL_NAME
+$LLVM_OPT -S -passes="loop-simplify" $LL_NAME -o $LL_NAME
 $LLVM_OPT -S -load-pass-plugin $MY_LLVM_LIB -passes="nisse" -stats \
     $LL_NAME -o $PF_NAME
 
@@ -71,7 +71,7 @@ $LLVM_OPT -S -passes="dot-cfg" -stats \
 
 # Compile the newly instrumented program, and link it against the profiler
 #
-$LLVM_CLANG -Wall -std=c99 $PF_NAME $PROFILER_IMPL -o $BS_NAME
+$LLVM_CLANG -Wall -std=c99 -pthread -I$SOURCE_DIR/include $PF_NAME $PROFILER_IMPL -o $BS_NAME
 ret_code=$?
 if [[ $ret_code -ne 0 ]]; then
   echo "Compilation failed"
@@ -0,0 +1,198 @@
+//===-- NisseAggregator.cpp --------------------------------------------===//
+// Copyright (C) 2023 Leon Frenot
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// This file contains the implementation of nisse-aggregator, a daemon that
+/// receives the profiles of instrumented programs run with
+/// NISSE_PROFILE_SOCKET over a Unix-domain socket, sums them in memory, and
+/// writes the sum as a single binary profile when asked to.
+///
+//===----------------------------------------------------------------------===//
+
+#include "NisseProfileReader.h"
+#include "llvm/Support/CommandLine.h"
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace llvm;
+using namespace nisse;
+
+/// \brief Set by SIGUSR1, to write the profile.
+static volatile sig_atomic_t FlushRequested = 0;
+
+/// \brief Set by SIGINT and SIGTERM, to write the profile and exit.
+static volatile sig_atomic_t ExitRequested = 0;
+
+/// \brief Handles the signals of the daemon.
+/// \param signal The signal received.
+static void handleSignal(int signal) {
+  if (signal == SIGUSR1)
+    FlushRequested = 1;
+  else
+    ExitRequested = 1;
+}
+
+/// \brief Opens a listening Unix-domain socket, replacing the stale socket of
+/// a previous daemon, if any.
+/// \param path The path of the socket.
+/// \return The socket, or -1 on failure.
+int openSocket(const string &path) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(address.sun_path, path.c_str());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  unlink(path.c_str());
+  if (::bind(fd, (sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/// \brief Writes the sum of the profiles received, replacing the output file
+/// at once, so that a reader never sees a partial profile.
+/// \param filename The output file.
+/// \param sums The sum of the profiles.
+/// \return false if the file could not be written.
+bool writeProfile(const string &filename, const ProfileSums &sums) {
+  string temporary = filename + ".tmp";
+  ofstream output(temporary, ios::binary | ios::trunc);
+  string record = buildBinaryProfile(sums);
+  if (!output.write(record.data(), record.size()))
+    return false;
+  output.close();
+  return rename(temporary.c_str(), filename.c_str()) == 0;
+}
+
+/// \brief Accepts the connections of instrumented programs, each sending one
+/// or more binary profile records before closing its connection, and sums
+/// them. Writes the sum on SIGUSR1, and on SIGINT or SIGTERM before exiting.
+/// \param argc (⊙ˍ⊙)
+/// \param argv (⊙ˍ⊙)
+/// \return 0, or 1 if the socket could not be opened.
+int main(int argc, char **argv) {
+  cl::opt<string> SocketPath(cl::Positional, cl::desc("<socket>"),
+                             cl::Required);
+  cl::opt<string> OutputFilename("o", cl::desc("Merged profile"),
+                                 cl::value_desc("filename"),
+                                 cl::init("merged.prof"));
+
+  cl::ParseCommandLineOptions(argc, argv);
+
+  // No SA_RESTART, so that poll returns when a signal is received.
+  struct sigaction action = {};
+  action.sa_handler = handleSignal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR1, &action, nullptr);
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+  signal(SIGPIPE, SIG_IGN);
+
+  int listener = openSocket(SocketPath);
+  if (listener < 0) {
+    cerr << "Could not listen on '" << SocketPath << "': " << strerror(errno)
+         << "\n";
+    return 1;
+  }
+
+  // The first entry is the listening socket, the others are clients, whose
+  // partial records are kept in buffers.
+  vector<pollfd> fds = {{listener, POLLIN, 0}};
+  vector<string> buffers = {""};
+  ProfileSums total;
+  unsigned long long received = 0, rejected = 0;
+
+  while (true) {
+    if (FlushRequested || ExitRequested) {
+      FlushRequested = 0;
+      if (!writeProfile(OutputFilename, total))
+        cerr << "Could not write '" << OutputFilename << "'\n";
+      else
+        cout << "Wrote " << received << " profiles to '" << OutputFilename
+             << "' (" << rejected << " rejected)" << endl;
+      if (ExitRequested)
+        break;
+    }
+
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      break;
+    }
+
+    for (size_t i = 1; i < fds.size(); i++) {
+      if (!fds[i].revents)
+        continue;
+      char chunk[1 << 16];
+      ssize_t count = read(fds[i].fd, chunk, sizeof(chunk));
+      if (count > 0) {
+        buffers[i].append(chunk, count);
+        continue;
+      }
+      if (count < 0 && (errno == EAGAIN || errno == EINTR))
+        continue;
+
+      // The client is done: its records are complete.
+      ModuleProfiles profiles;
+      if (count == 0 && parseBinaryProfile(buffers[i], profiles)) {
+        addProfile(total, profiles);
+        received += !buffers[i].empty();
+      } else {
+        rejected++;
+      }
+      close(fds[i].fd);
+      fds[i] = fds.back();
+      fds.pop_back();
+      buffers[i] = move(buffers.back());
+      buffers.pop_back();
+      i--;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int client;
+      while ((client = accept4(listener, nullptr, nullptr,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        fds.push_back({client, POLLIN, 0});
+        buffers.emplace_back();
+      }
+    }
+  }
+
+  for (auto &fd : fds)
+    close(fd.fd);
+  unlink(SocketPath.c_str());
+  return 0;
+}
@@ -0,0 +1,124 @@
+//===-- NisseJITRun.cpp ------------------------------------------------===//
+// Copyright (C) 2023 Leon Frenot
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// This file contains the implementation of nisse-jit, an example of the
+/// in-process API: it instruments a program given as LLVM IR, runs its main
+/// function with the ORC JIT, and prints the frequencies of its edges and
+/// blocks, without writing any file.
+///
+//===----------------------------------------------------------------------===//
+
+#include "NisseJIT.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include <iostream>
+
+using namespace std;
+using namespace llvm;
+using namespace nisse;
+
+/// \brief Promotes the allocas of a module to registers, as nisse_profiler.sh
+/// does, so that the nisse pass finds its induction variables.
+/// \param M The module.
+void promoteAllocas(Module &M) {
+  FunctionAnalysisManager FAM;
+  PassBuilder PB;
+  PB.registerFunctionAnalyses(FAM);
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+    PromotePass().run(F, FAM);
+  }
+}
+
+/// \brief Runs the main function of a program given as LLVM IR with the ORC
+/// JIT, and prints the frequencies of its edges and blocks. Programs in C are
+/// first compiled with clang -S -emit-llvm -Xclang -disable-O0-optnone.
+/// \param argc (⊙ˍ⊙)
+/// \param argv (⊙ˍ⊙)
+/// \return The exit code of the program, or 1 on failure.
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  cl::opt<string> InputFilename(cl::Positional, cl::desc("<IR file>"),
+                                cl::Required);
+  cl::list<string> InputArgv(cl::ConsumeAfter,
+                             cl::desc("<program arguments>..."));
+  cl::opt<bool> KS("ks", cl::desc("Use the ks instrumentation"));
+  cl::opt<bool> Atomic("atomic", cl::desc("Use atomic counters"));
+
+  cl::ParseCommandLineOptions(argc, argv);
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+
+  auto Context = make_unique<LLVMContext>();
+  SMDiagnostic Err;
+  auto M = parseIRFile(InputFilename, Err, *Context);
+  if (!M) {
+    Err.print(argv[0], errs());
+    return 1;
+  }
+
+  promoteAllocas(*M);
+  auto Profile = JITProfile::instrument(
+      *M, KS ? JITInstrumentation::KS : JITInstrumentation::Nisse,
+      Atomic ? CounterMode::Atomic : CounterMode::Plain);
+
+  auto ExitOnErr = ExitOnError(string(argv[0]) + ": ");
+  auto J = ExitOnErr(orc::LLJITBuilder().create());
+  J->getMainJITDylib().addGenerator(
+      ExitOnErr(orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+          J->getDataLayout().getGlobalPrefix())));
+  ExitOnErr(J->addIRModule(
+      orc::ThreadSafeModule(std::move(M), std::move(Context))));
+  ExitOnErr(Profile->attach(*J));
+  ExitOnErr(J->initialize(J->getMainJITDylib()));
+
+  vector<string> Args = {InputFilename};
+  Args.insert(Args.end(), InputArgv.begin(), InputArgv.end());
+  vector<char *> ArgvPtrs;
+  for (auto &Arg : Args)
+    ArgvPtrs.push_back(Arg.data());
+  ArgvPtrs.push_back(nullptr);
+
+  auto MainSym = ExitOnErr(J->lookup("main"));
+  auto *Main = jitTargetAddressToFunction<int (*)(int, char **)>(
+      MainSym.getAddress());
+  int Result = Main(Args.size(), ArgvPtrs.data());
+  ExitOnErr(J->deinitialize(J->getMainJITDylib()));
+
+  for (auto &[function, frequencies] : Profile->getFrequencies()) {
+    cout << "Printing the weights of '" << function << "'...\n";
+    for (size_t e = 0; e < frequencies.edges.size(); e++) {
+      cout << frequencies.edges[e].first << " -> "
+           << frequencies.edges[e].second << " : "
+           << frequencies.edgeCounts[e] << '\n';
+    }
+    cout << "Blocks:";
+    for (auto &[block, count] : frequencies.blockCounts)
+      cout << ' ' << block << " : " << count << ';';
+    cout << "\n\n";
+  }
+
+  return Result;
+}
@@ -0,0 +1,104 @@
+//===-- NisseMerge.cpp -------------------------------------------------===//
+// Copyright (C) 2023 Leon Frenot
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// This file contains the implementation of nisse-merge, which sums any
+/// number of profiles, such as the per-process profiles of a server, into a
+/// single binary profile.
+///
+//===----------------------------------------------------------------------===//
+
+#include "NisseProfile.h"
+#include "NisseProfileReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ThreadPool.h"
+#include <fstream>
+#include <iostream>
+#include <mutex>
+
+using namespace std;
+using namespace llvm;
+using namespace nisse;
+
+/// \brief Sums the profiles given as arguments, reading them in parallel, and
+/// writes the result as a single binary profile record.
+/// \param argc (⊙ˍ⊙)
+/// \param argv (⊙ˍ⊙)
+/// \return 0, or 1 if a profile could not be read.
+int main(int argc, char **argv) {
+  cl::list<string> InputFilenames(cl::Positional, cl::desc("<prof files>"),
+                                  cl::OneOrMore);
+  cl::opt<string> OutputFilename("o", cl::desc("Merged profile"),
+                                 cl::value_desc("filename"),
+                                 cl::init("merged.prof"));
+  cl::opt<string> InfoFilename(
+      "info", cl::desc("Info file, needed to read text profiles"),
+      cl::value_desc("filename"));
+  cl::opt<unsigned> Threads("j", cl::init(0),
+                            cl::desc("Number of threads (0 for all cores)"));
+
+  cl::ParseCommandLineOptions(argc, argv);
+
+  FunctionSizes infos;
+  if (!InfoFilename.empty() && !readInfoFile(InfoFilename, infos)) {
+    cerr << "Could not open info file '" << InfoFilename << "'\n";
+    return 1;
+  }
+
+  // Each task sums its profile into the total, which is only locked once the
+  // profile is read.
+  ProfileSums total;
+  mutex totalLock;
+  bool failed = false;
+  ThreadPool pool(Threads ? hardware_concurrency(Threads)
+                          : hardware_concurrency());
+  for (auto &filename : InputFilenames) {
+    pool.async([&, filename]() {
+      // Text profiles do not tell their module, and are summed as module 0.
+      ModuleProfiles profiles;
+      bool ok;
+      if (isBinaryProfile(filename))
+        ok = readBinaryProfile(filename, profiles);
+      else if (!infos.empty())
+        ok = readTextProfile(filename, infos, profiles[0]);
+      else
+        ok = false;
+
+      lock_guard<mutex> guard(totalLock);
+      if (!ok) {
+        cerr << "Could not read profile '" << filename << "'\n";
+        failed = true;
+        return;
+      }
+      addProfile(total, profiles);
+    });
+  }
+  pool.wait();
+
+  if (failed)
+    return 1;
+
+  ofstream output(OutputFilename, ios::binary | ios::trunc);
+  string record = buildBinaryProfile(total);
+  if (!output.write(record.data(), record.size())) {
+    cerr << "Could not write '" << OutputFilename << "'\n";
+    return 1;
+  }
+  cout << "Merged " << InputFilenames.size() << " profiles into '"
+       << OutputFilename << "'\n";
+  return 0;
+}
@@ -21,227 +21,19 @@
 ///
 //===----------------------------------------------------------------------===//
 
+#include "NissePropagation.h"
+#include "NisseProfileReader.h"
 #include "llvm/Support/CommandLine.h"
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <set>
+#include <tuple>
 #include <utility>
 
 using namespace std;
 using namespace llvm;
-
-/// \brief Shorthand for long long int
-using ll = long long int;
-/// \brief Shorthand for vector of long long int.
-using vi = vector<ll>;
-/// \brief Shorthand for vector of vector of long long int.
-using vvi = vector<vi>;
-/// \brief Shorthand for vector of pairs of long long int.
-using vpi = vector<pair<ll, ll>>;
-/// \brief Shorthand for set of long long int.
-using si = set<ll>;
-/// \brief Shorthand for map from int to set of long long int.
-using msi = map<ll, si>;
-
-using vs = vector<string>;
-using mss = map<string, si>;
-using vps = vector<pair<string, string>>;
-
-/// \brief Initialises the variables given as input with the graph described by
-/// the file input.
-/// \param input Path to the input file.
-/// \param vertex The graph's vertices.
-/// \param edges The graph's edges.
-/// \param ST A spanning tree of the graph.
-/// \param revST The edges not in the spanning tree.
-/// \param in in[x] contains the edges towards x.
-/// \param out out[x] contains the edges from x.
-/// \param debug Flag for the debug messages.
-void initGraph(string input, vs &vertex, vps &edges, si &ST, si &revST, mss &in,
-               mss &out, bool debug) {
-  int count;
-  ifstream graph;
-  graph.open(input + ".graph");
-  graph >> count;
-
-  if (debug)
-    cout << count << endl;
-
-  for (int i = 0; i < count; i++) {
-    string tmp;
-    graph >> tmp;
-    vertex.push_back(tmp);
-    in[tmp] = si();
-    out[tmp] = si();
-  }
-
-  if (debug) {
-    for (auto i : vertex) {
-      cout << i << " ";
-    }
-    cout << endl;
-  }
-
-  graph >> count;
-  edges = vps(count);
-  for (int i = 0; i < count; i++) {
-    int j;
-    string a, b;
-    graph >> j >> a >> b;
-    edges[j] = make_pair(a, b);
-    out[a].insert(j);
-    in[b].insert(j);
-  }
-
-  if (debug) {
-    for (auto p : edges) {
-      cout << p.first << ' ' << p.second << '\n';
-    }
-    cout << endl;
-  }
-
-  graph >> count;
-  for (int i = 0; i < count; i++) {
-    int tmp;
-    graph >> tmp;
-    ST.insert(tmp);
-  }
-
-  if (debug) {
-    for (auto i : ST) {
-      cout << i << " ";
-    }
-    cout << endl;
-  }
-
-  graph >> count;
-  for (int i = 0; i < count; i++) {
-    int tmp;
-    graph >> tmp;
-    revST.insert(tmp);
-  }
-
-  if (debug) {
-    for (auto i : revST) {
-      cout << i << " ";
-    }
-    cout << endl;
-  }
-
-  graph.close();
-}
-
-/// \brief Initialises the edge weights based on the input file. If there are
-/// multiple profilings, will sum each of them to get the total profile.
-/// \param input Path to the input file.
-/// \param edgeCount Number of edges in the graph.
-/// \param instCount Number of instrumented edges.
-/// \param debug Flag for the debug messages.
-/// \return The weights of the edges, initialized at 0, or at the total value
-/// given in the input file.
-vi initWeights(string input, vpi &prof, int edgeCount, int instCount, bool debug) {
-  vi weights(edgeCount, 0);
-  for (auto [edge, weight] : prof) {
-    weights[edge] = weight;
-  }
-
-  if (debug) {
-    for (auto i : weights) {
-      cout << i << " ";
-    }
-    cout << endl;
-  }
-
-  return weights;
-}
-
-/// \brief Propagates the weights across the entire graph.
-/// \param edges The graph's edges.
-/// \param ST The graph's spanning tree (edges that have not been instrumented).
-/// \param in in[x] contains the edges towards x.
-/// \param out out[x] contains the edges from x.
-/// \param weights The edge's weights.
-/// \param v The vertex to propagate from.
-/// \param e The edge to propagate from (not used on the initial call to the
-/// function).
-void propagation(vps &edges, si &ST, mss &in, mss &out, vi &weights, string v,
-                 int e = -1) {
-  ll in_sum = 0;
-  for (auto ep : in[v]) {
-    if (ep != e && ST.count(ep) == 1) {
-      propagation(edges, ST, in, out, weights, edges[ep].first, ep);
-    }
-    in_sum += weights[ep];
-  }
-
-  ll out_sum = 0;
-  for (auto ep : out[v]) {
-    if (ep != e && ST.count(ep) == 1) {
-      propagation(edges, ST, in, out, weights, edges[ep].second, ep);
-    }
-    out_sum += weights[ep];
-  }
-
-  if (e != -1) {
-    weights[e] = max(in_sum, out_sum) - min(in_sum, out_sum);
-  }
-}
-
-/// \brief Outputs the weights of the edges to the standard output.
-/// \param edges The graph's edges.
-/// \param weights The edge's weights.
-void outputCout(vps &edges, vi &weights) {
-  int size = edges.size();
-  for (int i = 0; i < size; i++) {
-    cout << edges[i].first << " -> " << edges[i].second << " : "
-         << weights[i] << '\n';
-  }
-  cout << endl;
-}
-
-/// \brief Outputs the weights of the edges to the file given as input.
-/// \param filename The path to the file to write the results.
-/// \param edges The graph's edges.
-/// \param weights The edge's weights.
-void outputFile(string filename, vps &edges, vi &weights) {
-  ofstream file, bbFile;
-  file.open(filename+".edges", ios::out | ios::app);
-
-  if (file.bad()) {
-    cout << "Could not open file " << filename+".edges" << endl;
-    outputCout(edges, weights);
-  }
-
-  int size = edges.size();
-  for (int i = 0; i < size; i++) {
-    file << edges[i].first << " -> " << edges[i].second << " : "
-         << weights[i] << '\n';
-  }
-
-  file << endl;
-  file.close();
-
-  bbFile.open(filename+".bb", ios::out | ios::app);
-
-  if (bbFile.bad()) {
-    cout << "Could not open file " << filename+".bb" << endl;
-    outputCout(edges, weights);
-  }
-
-  map<string,ll> bbFrequency;
-  for (int i = 0; i < size; i++) {
-    // if (edges[i].first == "0") bbFrequency["0"] += weights[i];
-    bbFrequency[edges[i].second] += weights[i];
-  }
-
-  for (auto [bb, freq] : bbFrequency) {
-    bbFile << bb << " : " << freq << '\n';
-  }
-
-  bbFile << endl;
-  bbFile.close();
-}
+using namespace nisse;
 
 /// \brief Propagates the weights given by edge instrumentation. If the graph is
 /// described in x.graph and the profiling in x.prof, call with x as the input
@@ -261,78 +53,95 @@ int main(int argc, char **argv) {
       "s", cl::desc("Do separate profilings for each function execution"));
 
   cl::ParseCommandLineOptions(argc, argv);
+  FunctionSizes infos;
   vector<string> functions;
-  map<string, int> functionSizes;
   map<string, vpi> functionProfiles;
-  
-  {
-    ifstream info_file;
-    info_file.open(InfoFilename);
-    string function_name;
-    int sz;
-    while (info_file >> function_name >> sz) {
-      functions.emplace_back(function_name);
-      functionSizes[function_name] = sz;
-    }
-    info_file.close();
-  }
 
-
-  {
-    ifstream prof_file;
-    prof_file.open(ProfFilename);
-    for (auto function_name : functions) {
-      auto sz = functionSizes[function_name];
-      functionProfiles[function_name] = {};
-      while (sz--) {
-        ll idx, count;
-        prof_file >> idx >> count;
-        functionProfiles[function_name].emplace_back(idx, count);
-      }
+  if (!readInfoFile(InfoFilename, infos)) {
+    cerr << "Could not open info file '" << InfoFilename << "'\n";
+    return 1;
+  }
+  for (auto &[function_name, sz] : infos)
+    functions.emplace_back(function_name);
+
+  // The profiles to propagate, along with the suffix of their output files
+  // and their heading. A snapshot file gives one profile per interval.
+  vector<tuple<string, string, map<string, vpi>>> intervals;
+  if (isSnapshotFile(ProfFilename)) {
+    vector<Snapshot> snapshots;
+    if (!readSnapshots(ProfFilename, snapshots)) {
+      cerr << "Malformed snapshot file '" << ProfFilename << "'\n";
+      return 1;
+    }
+    if (snapshots.empty()) {
+      cerr << "No snapshots in '" << ProfFilename << "'\n";
+      return 1;
+    }
+    for (auto &snapshot : snapshots) {
+      intervals.emplace_back("." + to_string(snapshot.sequence),
+                             "Interval " + to_string(snapshot.sequence) +
+                                 ", until " +
+                                 to_string(snapshot.timeNs / 1000000) + " ms",
+                             move(snapshot.functionProfiles));
+    }
+  } else if (isBinaryProfile(ProfFilename)) {
+    if (!readBinaryProfile(ProfFilename, functionProfiles)) {
+      cerr << "Malformed binary profile '" << ProfFilename << "'\n";
+      return 1;
     }
-    prof_file.close();
+  } else if (!readTextProfile(ProfFilename, infos, functionProfiles)) {
+    cerr << "Truncated text profile '" << ProfFilename << "'\n";
+    return 1;
   }
 
-  for (auto function_name : functions) {
-    auto prof = functionProfiles[function_name];
+  if (intervals.empty())
+    intervals.emplace_back("", "", move(functionProfiles));
 
-    vs vertex;
-    vps edges;
-    si ST, revST;
-    mss in, out;
-    vvi weights;
+  for (auto &[suffix, heading, profiles] : intervals) {
+    if (!heading.empty())
+      cout << heading << "...\n\n";
+    for (auto function_name : functions) {
+      auto prof = profiles[function_name];
 
-    if (Debug) {
-      cout << "\nComputing the graph of " << function_name << "\n\n";
-    }
+      vs vertex;
+      vps edges;
+      si ST, revST;
+      mss in, out;
+      vvi weights;
 
-    initGraph(function_name, vertex, edges, ST, revST, in, out, Debug);
+      if (Debug) {
+        cout << "\nComputing the graph of " << function_name << "\n\n";
+      }
 
-    if (Debug) {
-      cout << "\nComputing the input weights\n\n";
-    }
+      initGraph(function_name, vertex, edges, ST, revST, in, out, Debug);
 
-    weights.push_back(initWeights(function_name, prof, edges.size(), revST.size(), Debug));
+      if (Debug) {
+        cout << "\nComputing the input weights\n\n";
+      }
 
-    if (Debug) {
-      cout << "\nPropagating the weights\n\n";
-    }
-    bool to_print = true;
-    for (auto w : weights) {
-      propagation(edges, ST, in, out, w, "0");
+      weights.push_back(initWeights(function_name, prof, edges.size(), revST.size(), Debug));
 
-      if (OutputExtension.size() > 0) {
-        if (to_print) {
-          cout << "Writing '" << function_name << OutputExtension << "'... and\n";
-          to_print = false;
-        }
-        outputFile(function_name + OutputExtension, edges, w);
-      } else {
-        if (to_print) {
-          cout << "Printing the weights of '" << function_name << "'...\n";
-          to_print = false;
+      if (Debug) {
+        cout << "\nPropagating the weights\n\n";
+      }
+      bool to_print = true;
+      for (auto w : weights) {
+        propagateForest(vertex, edges, ST, in, out, w);
+
+        if (OutputExtension.size() > 0) {
+          if (to_print) {
+            cout << "Writing '" << function_name << suffix << OutputExtension
+                 << "'... and\n";
+            to_print = false;
+          }
+          outputFile(function_name + suffix + OutputExtension, edges, w);
+        } else {
+          if (to_print) {
+            cout << "Printing the weights of '" << function_name << "'...\n";
+            to_print = false;
+          }
+          outputCout(edges, w);
         }
-        outputCout(edges, w);
       }
     }
   }
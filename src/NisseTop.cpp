@@ -0,0 +1,134 @@
+//===-- NisseTop.cpp ---------------------------------------------------===//
+// Copyright (C) 2023 Leon Frenot
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// This file contains the implementation of nisse-top, which periodically
+/// reads the counters that a running program exports in shared memory, and
+/// prints its hottest edges.
+///
+//===----------------------------------------------------------------------===//
+
+#include "NisseProfileReader.h"
+#include "NissePropagation.h"
+#include "llvm/Support/CommandLine.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <tuple>
+#include <unistd.h>
+
+using namespace std;
+using namespace llvm;
+using namespace nisse;
+
+/// \brief Copies the record held by a shared memory segment. The program
+/// keeps updating its counters during the copy, so a snapshot is not atomic,
+/// but each counter is read whole.
+/// \param name The name of the segment.
+/// \param snapshot The copy of the segment.
+/// \return false if the segment could not be read.
+bool readSegment(const string &name, string &snapshot) {
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+
+  void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED)
+    return false;
+
+  snapshot.assign((const char *)mapped, st.st_size);
+  munmap(mapped, st.st_size);
+  return true;
+}
+
+/// \brief Attaches to the shared memory segment of a program instrumented in
+/// continuous mode and run with NISSE_PROFILE_SHM, and prints its hottest
+/// edges at each interval, until the segment is removed.
+/// \param argc (⊙ˍ⊙)
+/// \param argv (⊙ˍ⊙)
+/// \return 0
+int main(int argc, char **argv) {
+  cl::opt<string> Segment(cl::Positional, cl::desc("<segment>"), cl::Required);
+  cl::opt<unsigned> Interval("interval", cl::init(1),
+                             cl::desc("Seconds between two snapshots"));
+  cl::opt<unsigned> Count("n", cl::init(0),
+                          cl::desc("Number of snapshots (0 for no limit)"));
+  cl::opt<unsigned> Top("top", cl::init(10),
+                        cl::desc("Number of edges printed per snapshot"));
+  cl::opt<string> GraphDir("graph-dir", cl::init("."),
+                           cl::desc("Directory of the .graph files"),
+                           cl::value_desc("directory"));
+
+  cl::ParseCommandLineOptions(argc, argv);
+
+  map<string, ll> previous;
+  for (unsigned snapshot = 1; Count == 0 || snapshot <= Count; snapshot++) {
+    if (snapshot > 1)
+      sleep(Interval);
+
+    string buffer;
+    map<string, EdgeCounts> functionProfiles;
+    if (!readSegment(Segment, buffer)) {
+      if (snapshot == 1) {
+        cerr << "Could not read segment '" << Segment << "'\n";
+        return 1;
+      }
+      cout << "Segment '" << Segment << "' is gone\n";
+      return 0;
+    }
+    if (!parseBinaryProfile(buffer, functionProfiles)) {
+      cerr << "Malformed segment '" << Segment << "'\n";
+      return 1;
+    }
+
+    // Each edge, with its weight and its increase since the last snapshot.
+    vector<tuple<ll, ll, string>> hottest;
+    map<string, ll> current;
+    for (auto &[function, counts] : functionProfiles) {
+      vps edges;
+      vi weights = propagateFunction(GraphDir + "/" + function, counts, edges);
+      for (size_t i = 0; i < edges.size(); i++) {
+        string name =
+            function + ": " + edges[i].first + " -> " + edges[i].second;
+        current[name] = weights[i];
+        hottest.emplace_back(weights[i], weights[i] - previous[name], name);
+      }
+    }
+    previous = move(current);
+
+    std::sort(hottest.begin(), hottest.end(), greater<>());
+    if (hottest.size() > Top)
+      hottest.resize(Top);
+
+    cout << "Snapshot " << snapshot << " of '" << Segment << "'...\n";
+    for (auto &[weight, delta, name] : hottest) {
+      cout << name << " : " << weight << " (+" << delta << ")\n";
+    }
+    cout << endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,248 @@
+//===-- Propagation.cpp ------------------------------------------------===//
+// Copyright (C) 2023 Leon Frenot
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// This file contains the implementation of the weight propagation
+///
+//===----------------------------------------------------------------------===//
+
+#include "NissePropagation.h"
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+
+namespace nisse {
+
+void initGraph(string input, vs &vertex, vps &edges, si &ST, si &revST, mss &in,
+               mss &out, bool debug) {
+  ifstream graph;
+  graph.open(input + ".graph");
+  readGraph(graph, vertex, edges, ST, revST, in, out, debug);
+  graph.close();
+}
+
+void readGraph(istream &graph, vs &vertex, vps &edges, si &ST, si &revST,
+               mss &in, mss &out, bool debug) {
+  int count;
+  graph >> count;
+
+  if (debug)
+    cout << count << endl;
+
+  for (int i = 0; i < count; i++) {
+    string tmp;
+    graph >> tmp;
+    vertex.push_back(tmp);
+    in[tmp] = si();
+    out[tmp] = si();
+  }
+
+  if (debug) {
+    for (auto i : vertex) {
+      cout << i << " ";
+    }
+    cout << endl;
+  }
+
+  graph >> count;
+  edges = vps(count);
+  for (int i = 0; i < count; i++) {
+    int j;
+    string a, b;
+    graph >> j >> a >> b;
+    edges[j] = make_pair(a, b);
+    out[a].insert(j);
+    in[b].insert(j);
+  }
+
+  if (debug) {
+    for (auto p : edges) {
+      cout << p.first << ' ' << p.second << '\n';
+    }
+    cout << endl;
+  }
+
+  graph >> count;
+  for (int i = 0; i < count; i++) {
+    int tmp;
+    graph >> tmp;
+    ST.insert(tmp);
+  }
+
+  if (debug) {
+    for (auto i : ST) {
+      cout << i << " ";
+    }
+    cout << endl;
+  }
+
+  graph >> count;
+  for (int i = 0; i < count; i++) {
+    int tmp;
+    graph >> tmp;
+    revST.insert(tmp);
+  }
+
+  if (debug) {
+    for (auto i : revST) {
+      cout << i << " ";
+    }
+    cout << endl;
+  }
+}
+
+vi initWeights(string input, vpi &prof, int edgeCount, int instCount, bool debug) {
+  vi weights(edgeCount, 0);
+  for (auto [edge, weight] : prof) {
+    // A corrupt profile may name edges that the function does not have.
+    if (edge >= 0 && edge < edgeCount)
+      weights[edge] = weight;
+  }
+
+  if (debug) {
+    for (auto i : weights) {
+      cout << i << " ";
+    }
+    cout << endl;
+  }
+
+  return weights;
+}
+
+void propagation(vps &edges, si &ST, mss &in, mss &out, vi &weights, string v,
+                 int e) {
+  ll in_sum = 0;
+  for (auto ep : in[v]) {
+    if (ep != e && ST.count(ep) == 1) {
+      propagation(edges, ST, in, out, weights, edges[ep].first, ep);
+    }
+    in_sum += weights[ep];
+  }
+
+  ll out_sum = 0;
+  for (auto ep : out[v]) {
+    if (ep != e && ST.count(ep) == 1) {
+      propagation(edges, ST, in, out, weights, edges[ep].second, ep);
+    }
+    out_sum += weights[ep];
+  }
+
+  if (e != -1) {
+    weights[e] = max(in_sum, out_sum) - min(in_sum, out_sum);
+  }
+}
+
+void propagateForest(vs &vertex, vps &edges, si &ST, mss &in, mss &out,
+                     vi &weights) {
+  propagation(edges, ST, in, out, weights, "0");
+
+  // The edges out of dispatch blocks are all counted, so the edges left may
+  // only span a forest. Each other tree is propagated from a block where the
+  // flow is not conserved, if any, as the weights of its edges are not needed
+  // to balance its root.
+  set<string> reached;
+  auto collect = [&](const string &root) {
+    vs tree = {root};
+    reached.insert(root);
+    for (size_t i = 0; i < tree.size(); i++) {
+      for (auto ep : in[tree[i]])
+        if (ST.count(ep) && reached.insert(edges[ep].first).second)
+          tree.push_back(edges[ep].first);
+      for (auto ep : out[tree[i]])
+        if (ST.count(ep) && reached.insert(edges[ep].second).second)
+          tree.push_back(edges[ep].second);
+    }
+    return tree;
+  };
+  collect("0");
+  for (auto &v : vertex) {
+    if (reached.count(v))
+      continue;
+    vs tree = collect(v);
+    string root = v;
+    for (auto &u : tree)
+      if (out[u].empty())
+        root = u;
+    propagation(edges, ST, in, out, weights, root);
+  }
+}
+
+vi propagateFunction(const string &function, vpi &prof, vps &edges) {
+  ifstream graph(function + ".graph");
+  return propagateGraph(graph, prof, edges);
+}
+
+vi propagateGraph(istream &graph, vpi &prof, vps &edges) {
+  vs vertex;
+  si ST, revST;
+  mss in, out;
+  readGraph(graph, vertex, edges, ST, revST, in, out, false);
+  vi weights = initWeights("", prof, edges.size(), revST.size(), false);
+  propagateForest(vertex, edges, ST, in, out, weights);
+  return weights;
+}
+
+void outputCout(vps &edges, vi &weights) {
+  int size = edges.size();
+  for (int i = 0; i < size; i++) {
+    cout << edges[i].first << " -> " << edges[i].second << " : "
+         << weights[i] << '\n';
+  }
+  cout << endl;
+}
+
+void outputFile(string filename, vps &edges, vi &weights) {
+  ofstream file, bbFile;
+  file.open(filename+".edges", ios::out | ios::app);
+
+  if (file.bad()) {
+    cout << "Could not open file " << filename+".edges" << endl;
+    outputCout(edges, weights);
+  }
+
+  int size = edges.size();
+  for (int i = 0; i < size; i++) {
+    file << edges[i].first << " -> " << edges[i].second << " : "
+         << weights[i] << '\n';
+  }
+
+  file << endl;
+  file.close();
+
+  bbFile.open(filename+".bb", ios::out | ios::app);
+
+  if (bbFile.bad()) {
+    cout << "Could not open file " << filename+".bb" << endl;
+    outputCout(edges, weights);
+  }
+
+  map<string,ll> bbFrequency;
+  for (int i = 0; i < size; i++) {
+    // if (edges[i].first == "0") bbFrequency["0"] += weights[i];
+    bbFrequency[edges[i].second] += weights[i];
+  }
+
+  for (auto [bb, freq] : bbFrequency) {
+    bbFile << bb << " : " << freq << '\n';
+  }
+
+  bbFile << endl;
+  bbFile.close();
+}
+
+} // namespace nisse
@@ -0,0 +1,27 @@
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define NUM_WORKERS 4
+
+long work(int n) {
+  long sum = 0;
+  for (int i = 0; i < n; i++) {
+    if (i % 2 == 0)
+      sum += i;
+  }
+  return sum;
+}
+
+int main() {
+  work(10);
+  for (int i = 0; i < NUM_WORKERS; i++) {
+    if (fork() == 0) {
+      work(100);
+      return 0;
+    }
+  }
+  for (int i = 0; i < NUM_WORKERS; i++) {
+    wait(0);
+  }
+  return 0;
+}
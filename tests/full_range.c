@@ -0,0 +1,28 @@
+/* A switch whose cases cover every value of its condition, a signed char, to
+ * try -nisse-dispatch-counters=2: the range of the table is the whole range
+ * of the type. */
+
+#include <stdio.h>
+
+#define CASE(v) case v: return (v) & 3;
+#define CASE4(v) CASE(v) CASE(v + 1) CASE(v + 2) CASE(v + 3)
+#define CASE16(v) CASE4(v) CASE4(v + 4) CASE4(v + 8) CASE4(v + 12)
+#define CASE64(v) CASE16(v) CASE16(v + 16) CASE16(v + 32) CASE16(v + 48)
+
+int classify(signed char c) {
+  switch (c) {
+    CASE64(-128)
+    CASE64(-64)
+    CASE64(0)
+    CASE64(64)
+  }
+  return 9;
+}
+
+int main(void) {
+  int sum = 0;
+  for (int i = 0; i < 1000; i++)
+    sum += classify((signed char)i);
+  printf("%d\n", sum);
+  return 0;
+}
@@ -0,0 +1,67 @@
+/* A bytecode interpreter, with a switch and with computed gotos (a GNU
+ * extension), to try -nisse-dispatch-counters. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+enum { PUSH, ADD, SUB, MUL, DUP, SWAP, DROP, JNZ, DEC, HALT };
+
+/* Adds 3 to 1, 200 times. */
+static const int program[] = {PUSH, 1,   PUSH, 200, /* acc n */
+                              SWAP, PUSH, 3,   ADD, SWAP, /* acc += 3 */
+                              DEC,  DUP, JNZ,  4,   DROP, HALT};
+
+long run_switch(void) {
+  long stack[16];
+  int sp = 0, pc = 0;
+  for (;;) {
+    switch (program[pc++]) {
+    case PUSH: stack[sp++] = program[pc++]; break;
+    case ADD: sp--; stack[sp - 1] += stack[sp]; break;
+    case SUB: sp--; stack[sp - 1] -= stack[sp]; break;
+    case MUL: sp--; stack[sp - 1] *= stack[sp]; break;
+    case DUP: stack[sp] = stack[sp - 1]; sp++; break;
+    case SWAP: {
+      long t = stack[sp - 1];
+      stack[sp - 1] = stack[sp - 2];
+      stack[sp - 2] = t;
+      break;
+    }
+    case DROP: sp--; break;
+    case JNZ: sp--; pc = stack[sp] ? program[pc] : pc + 1; break;
+    case DEC: stack[sp - 1]--; break;
+    case HALT: return stack[sp - 1];
+    default: abort();
+    }
+  }
+}
+
+long run_threaded(void) {
+  static void *labels[] = {&&push, &&add, &&sub, &&mul, &&dup,
+                           &&swap, &&drop, &&jnz, &&dec, &&halt};
+  long stack[16];
+  int sp = 0, pc = 0;
+#define NEXT goto *labels[program[pc++]]
+  NEXT;
+push: stack[sp++] = program[pc++]; NEXT;
+add: sp--; stack[sp - 1] += stack[sp]; NEXT;
+sub: sp--; stack[sp - 1] -= stack[sp]; NEXT;
+mul: sp--; stack[sp - 1] *= stack[sp]; NEXT;
+dup: stack[sp] = stack[sp - 1]; sp++; NEXT;
+swap: {
+  long t = stack[sp - 1];
+  stack[sp - 1] = stack[sp - 2];
+  stack[sp - 2] = t;
+  NEXT;
+}
+drop: sp--; NEXT;
+jnz: sp--; pc = stack[sp] ? program[pc] : pc + 1; NEXT;
+dec: stack[sp - 1]--; NEXT;
+halt: return stack[sp - 1];
+#undef NEXT
+}
+
+int main() {
+  printf("%ld %ld\n", run_switch(), run_threaded());
+  return 0;
+}
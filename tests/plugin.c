@@ -0,0 +1,14 @@
+/* A plugin loaded by tests/plugin_host.c. Build it as a shared object, with
+ * its own instrumentation:
+ *   cc -shared -fPIC plugin.profiled.ll -o libplugin.so -lNisseRuntime */
+
+long plugin_work(int n) {
+  long sum = 0;
+  for (int i = 0; i < n; i++) {
+    if (i % 3 == 0)
+      sum += i;
+    else
+      sum -= 1;
+  }
+  return sum;
+}
@@ -0,0 +1,30 @@
+#include <dlfcn.h>
+#include <stdio.h>
+
+/* Loads the plugin given as argument (see tests/plugin.c) twice, so that its
+ * counters are written when it is unloaded, and registered anew when it is
+ * loaded again. */
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s libplugin.so\n", argv[0]);
+    return 1;
+  }
+
+  long sum = 0;
+  for (int round = 0; round < 2; round++) {
+    void *plugin = dlopen(argv[1], RTLD_NOW);
+    if (!plugin) {
+      fprintf(stderr, "%s\n", dlerror());
+      return 1;
+    }
+    long (*work)(int) = (long (*)(int))dlsym(plugin, "plugin_work");
+    for (int i = 0; i < 10; i++) {
+      if (i % 2 == 0)
+        sum += work(100);
+    }
+    dlclose(plugin);
+  }
+
+  printf("%ld\n", sum);
+  return 0;
+}
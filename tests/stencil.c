@@ -0,0 +1,41 @@
+/* Loop nests whose trip counts are computable, to try the trip-count
+ * counters: a 2D stencil, a triangular nest and a 3D nest. Their inner
+ * counts are summed in closed form, and added once per call. */
+
+#include <stdio.h>
+
+#define N 64
+
+static double grid[N][N], next[N][N];
+
+void smooth(int n) {
+  for (int i = 1; i < n - 1; i++)
+    for (int j = 1; j < n - 1; j++)
+      next[i][j] = (grid[i - 1][j] + grid[i + 1][j] + grid[i][j - 1] +
+                    grid[i][j + 1]) / 4;
+}
+
+long triangle(long n) {
+  long s = 0;
+  for (long i = 0; i < n; i++)
+    for (long j = 0; j <= i; j++)
+      s += j;
+  return s;
+}
+
+long box(long m) {
+  long s = 0;
+  for (long a = 0; a < 3; a++)
+    for (long b = 0; b < m; b++)
+      for (long c = 0; c < 5; c++)
+        s += b * c;
+  return s;
+}
+
+int main(int argc, char **argv) {
+  grid[N / 2][N / 2] = 1;
+  for (int k = 0; k < 10; k++)
+    smooth(N);
+  printf("%f %ld %ld\n", next[N / 2][N / 2 + 1], triangle(100), box(argc + 9));
+  return 0;
+}
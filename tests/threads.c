@@ -0,0 +1,23 @@
+#include <pthread.h>
+
+#define NUM_THREADS 8
+
+void *worker(void *arg) {
+  long sum = 0;
+  for (int i = 0; i < 1000000; i++) {
+    if (i % 4 == 0)
+      sum += i;
+  }
+  return (void *)sum;
+}
+
+int main() {
+  pthread_t threads[NUM_THREADS];
+  for (int i = 0; i < NUM_THREADS; i++) {
+    pthread_create(&threads[i], 0, worker, 0);
+  }
+  for (int i = 0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], 0);
+  }
+  return 0;
+}